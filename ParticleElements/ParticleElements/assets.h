@@ -0,0 +1,250 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+/// assets.h
+/// loads textures and shaders without stalling startup. Files are read and images decoded
+/// on the thread pool; only the gl calls (texture upload, compile, link) happen on the
+/// context thread, from update().
+
+#include <glad/glad.h>
+
+#include "shader.h"
+#include "threadpool.h"
+#include "spriteoutline.h"
+
+#include <stb/stb_image.h>
+
+#include <string>
+#include <vector>
+#include <future>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+struct ImageData
+{
+	unsigned char* data = nullptr;
+	int width = 0, height = 0, nrChannels = 0;
+	bool resampled = false; // data came from new[] rather than stbi_load
+	std::vector<glm::vec2> outline; // alpha trimmed polygon, only made for sprites
+
+	void release()
+	{
+		if (resampled)
+			delete[] data;
+		else
+			stbi_image_free(data);
+		data = nullptr;
+	}
+};
+
+class AssetLoader
+{
+public:
+	explicit AssetLoader(ThreadPool& pool) : pool(pool)
+	{
+		// stb's flip flag is global, set it before any worker starts decoding
+		stbi_set_flip_vertically_on_load(true);
+		// let the driver spread compiles over its own threads
+		if (glExt().parallelShaderCompile)
+			glExt().MaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+	}
+	// array texture with one layer per file, every layer resampled to layerSize x layerSize
+	// on the pool so sprites of any size can share it. Layers upload as they arrive,
+	// mipmaps are built once the last one is in. With outlines, each layer's alpha is traced
+	// on the pool as well and its OUTLINE_VERTICES corners written to its slot as it arrives;
+	// until then every slot holds the whole quad.
+	// ------------------------------------------------------------------------
+	void textureArray(unsigned int texture, const std::vector<std::string>& paths, int layerSize, GLint wrap, const glm::vec4& placeholder = glm::vec4(0.5f, 0.5f, 0.5f, 1.0f), std::vector<glm::vec2>* outlines = NULL)
+	{
+		int numLayers = (int)paths.size();
+		bool trace = outlines != NULL;
+		if (trace)
+		{
+			outlines->clear();
+			for (int layer = 0; layer < numLayers; layer++)
+			{
+				std::vector<glm::vec2> quad = quadOutline();
+				outlines->insert(outlines->end(), quad.begin(), quad.end());
+			}
+		}
+		std::vector<unsigned char> texels((size_t)layerSize * layerSize * numLayers * 4);
+		for (size_t i = 0; i < texels.size(); i++)
+			texels[i] = (unsigned char)(placeholder[i % 4] * 255.0f);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, layerSize, layerSize, numLayers, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+
+		PendingArray pending;
+		pending.ID = texture;
+		pending.layersLeft = numLayers;
+		pending.outlines = outlines;
+		for (int layer = 0; layer < numLayers; layer++)
+		{
+			std::string file = paths[layer];
+			PendingLayer l;
+			l.layer = layer;
+			l.path = file;
+			l.image = pool.submit([file, layerSize, trace] {
+				ImageData image;
+				image.data = stbi_load(file.c_str(), &image.width, &image.height, &image.nrChannels, 4);
+				image.nrChannels = 4;
+				if (image.data && (image.width != layerSize || image.height != layerSize))
+				{
+					ImageData resized = resample(image, layerSize, layerSize);
+					image.release();
+					image = resized;
+				}
+				if (trace && image.data)
+					image.outline = alphaOutline(image.data, image.width, image.height);
+				return image;
+			});
+			pending.layers.push_back(std::move(l));
+		}
+		arrays.push_back(std::move(pending));
+	}
+	// shader sources are read on the pool, the compile starts in update()
+	// ------------------------------------------------------------------------
+	void shader(Shader& shader, const char* vertexPath, const char* fragmentPath)
+	{
+		std::string vPath = vertexPath, fPath = fragmentPath;
+		PendingShader pending;
+		pending.shader = &shader;
+		pending.vertexCode = pool.submit([vPath] { return Shader::readFile(vPath.c_str()); });
+		pending.fragmentCode = pool.submit([fPath] { return Shader::readFile(fPath.c_str()); });
+		shaders.push_back(std::move(pending));
+	}
+	// call once per frame on the context thread. Uploads whatever finished decoding and
+	// starts or polls compiles; never waits on a worker or the driver.
+	// ------------------------------------------------------------------------
+	void update()
+	{
+		for (PendingShader& s : shaders)
+		{
+			if (!s.started && isDone(s.vertexCode) && isDone(s.fragmentCode))
+			{
+				s.shader->build(s.vertexCode.get(), s.fragmentCode.get());
+				s.started = true;
+			}
+		}
+		for (PendingArray& a : arrays)
+		{
+			for (PendingLayer& l : a.layers)
+			{
+				if (!l.uploaded && isDone(l.image))
+				{
+					ImageData image = l.image.get();
+					if (a.outlines && !image.outline.empty())
+					{
+						std::copy(image.outline.begin(), image.outline.end(), a.outlines->begin() + l.layer * OUTLINE_VERTICES);
+						std::cout << l.path << " trimmed to " << (int)(polygonArea(image.outline) * 100.0f + 0.5f) << "% of its quad" << std::endl;
+					}
+					uploadLayer(a.ID, l.layer, l.path, image);
+					l.uploaded = true;
+					if (--a.layersLeft == 0)
+					{
+						glBindTexture(GL_TEXTURE_2D_ARRAY, a.ID);
+						glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+						glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+					}
+				}
+			}
+		}
+	}
+	// every program has linked, the scene can be drawn (textures may still be placeholders)
+	bool shadersReady()
+	{
+		for (PendingShader& s : shaders)
+		{
+			if (!s.started || !s.shader->isReady())
+				return false;
+		}
+		return true;
+	}
+	bool texturesReady() const
+	{
+		for (const PendingArray& a : arrays)
+		{
+			if (a.layersLeft > 0)
+				return false;
+		}
+		return true;
+	}
+
+private:
+	struct PendingLayer
+	{
+		int layer;
+		std::string path;
+		std::future<ImageData> image;
+		bool uploaded = false;
+	};
+	struct PendingArray
+	{
+		unsigned int ID;
+		int layersLeft;
+		std::vector<PendingLayer> layers;
+		std::vector<glm::vec2>* outlines;
+	};
+	struct PendingShader
+	{
+		Shader* shader;
+		std::future<std::string> vertexCode, fragmentCode;
+		bool started = false;
+	};
+
+	ThreadPool& pool;
+	std::vector<PendingArray> arrays;
+	std::vector<PendingShader> shaders;
+
+	template<class T>
+	static bool isDone(const std::future<T>& f)
+	{
+		return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}
+
+	static void uploadLayer(unsigned int texture, int layer, const std::string& path, ImageData image)
+	{
+		if (!image.data)
+		{
+			std::cout << "Failed to load texture " << path << std::endl;
+			return;
+		}
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, image.width, image.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, image.data);
+		image.release();
+	}
+
+	// box filter when shrinking, nearest when growing
+	static ImageData resample(const ImageData& src, int width, int height)
+	{
+		ImageData dst;
+		dst.width = width;
+		dst.height = height;
+		dst.nrChannels = src.nrChannels;
+		dst.resampled = true;
+		dst.data = new unsigned char[(size_t)width * height * src.nrChannels];
+		for (int y = 0; y < height; y++)
+		{
+			int y0 = y * src.height / height;
+			int y1 = std::max(y0 + 1, (y + 1) * src.height / height);
+			for (int x = 0; x < width; x++)
+			{
+				int x0 = x * src.width / width;
+				int x1 = std::max(x0 + 1, (x + 1) * src.width / width);
+				for (int c = 0; c < src.nrChannels; c++)
+				{
+					unsigned int sum = 0;
+					for (int sy = y0; sy < y1; sy++)
+						for (int sx = x0; sx < x1; sx++)
+							sum += src.data[((size_t)sy * src.width + sx) * src.nrChannels + c];
+					dst.data[((size_t)y * width + x) * src.nrChannels + c] = (unsigned char)(sum / ((y1 - y0) * (x1 - x0)));
+				}
+			}
+		}
+		return dst;
+	}
+};
+#endif
@@ -0,0 +1,42 @@
+#version 330 core
+// upsamples the particles over the full resolution scene. Bilinear where the four nearest
+// low resolution texels are at the scene's depth, otherwise the one closest to it.
+out vec4 FragColor;
+
+uniform sampler2D particles; // premultiplied colour, alpha is what shows through
+uniform sampler2D particleDepth;
+uniform sampler2D sceneDepth;
+uniform vec2 clipPlanes; // near, far
+
+const float edgeThreshold = 0.1; // fraction of the view distance
+
+float viewDepth(float depth)
+{
+	float n = clipPlanes.x, f = clipPlanes.y;
+	return 2.0 * n * f / (f + n - (depth * 2.0 - 1.0) * (f - n));
+}
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = viewDepth(texelFetch(sceneDepth, pixel, 0).r);
+	vec2 uv = gl_FragCoord.xy / vec2(textureSize(sceneDepth, 0));
+
+	ivec2 lowSize = textureSize(particles, 0);
+	ivec2 base = ivec2(floor(uv * vec2(lowSize) - 0.5));
+	ivec2 nearest = base;
+	float nearestDiff = 1e30;
+	bool edge = false;
+	for (int i = 0; i < 4; i++)
+	{
+		ivec2 texel = clamp(base + ivec2(i & 1, i >> 1), ivec2(0), lowSize - 1);
+		float diff = abs(viewDepth(texelFetch(particleDepth, texel, 0).r) - depth);
+		if (diff < nearestDiff)
+		{
+			nearestDiff = diff;
+			nearest = texel;
+		}
+		edge = edge || diff > edgeThreshold * depth;
+	}
+	FragColor = edge ? texelFetch(particles, nearest, 0) : texture(particles, uv);
+}
@@ -0,0 +1,17 @@
+#version 330 core
+// scene depth at particle resolution, keeping the nearest of each block so particles are
+// never drawn over anything that covers part of it
+
+uniform sampler2D sceneDepth;
+uniform int scale;
+
+void main()
+{
+	ivec2 last = textureSize(sceneDepth, 0) - 1;
+	ivec2 base = ivec2(gl_FragCoord.xy) * scale;
+	float depth = 1.0;
+	for (int y = 0; y < scale; y++)
+		for (int x = 0; x < scale; x++)
+			depth = min(depth, texelFetch(sceneDepth, min(base + ivec2(x, y), last), 0).r);
+	gl_FragDepth = depth;
+}
@@ -0,0 +1,145 @@
+#ifndef DEPTHSORT_H
+#define DEPTHSORT_H
+
+/// depthsort.h
+/// back to front order for the particle instances that reuses last frame's. Depth along the
+/// camera's view direction doesn't change with where the camera is, only with where it looks
+/// and how far particles drift in a frame, so last frame's order is nearly right. It is
+/// carried over by particle (slot and id), repaired with an insertion sort that gives up after
+/// a few moves per particle, and newly spawned particles are sorted on their own and merged in.
+/// A sharp turn of the camera, or a repair that runs over budget, falls back to a full sort.
+
+#include <glm/glm.hpp>
+
+#include <math.h>
+
+#include <vector>
+#include <algorithm>
+
+class DepthSorter
+{
+public:
+	DepthSorter() {}
+	DepthSorter(const DepthSorter&) = delete;
+	DepthSorter& operator=(const DepthSorter&) = delete;
+
+	// maxSlots is the size of the particle container. Turning further than maxTurnDegrees
+	// between frames, or a repair moving more than movesPerParticle per particle, sorts in full.
+	// ------------------------------------------------------------------------
+	void init(int maxSlots, bool incremental, float maxTurnDegrees = 5.0f, int movesPerParticle = 8)
+	{
+		lookup.assign(maxSlots, -1);
+		this->incremental = incremental;
+		minTurnCos = cosf(glm::radians(maxTurnDegrees));
+		this->movesPerParticle = movesPerParticle;
+		previousSlot.clear();
+		previousId.clear();
+	}
+	void setIncremental(bool incremental)
+	{
+		this->incremental = incremental;
+	}
+	bool isIncremental() const
+	{
+		return incremental;
+	}
+	// whether the last sort had to start from scratch
+	bool lastWasFull() const
+	{
+		return full;
+	}
+	// instance indices far to near. slot and id say which particle each instance is.
+	// ------------------------------------------------------------------------
+	const std::vector<int>& sort(int count, const glm::vec4* posSize, const int* slot, const unsigned int* id, glm::vec3 front)
+	{
+		depth.resize(count);
+		for (int i = 0; i < count; i++)
+			depth[i] = -glm::dot(glm::vec3(posSize[i]), front);
+		auto farther = [this](int a, int b) { return depth[a] < depth[b]; };
+
+		full = !incremental || previousSlot.empty() || glm::dot(front, previousFront) < minTurnCos;
+		if (!full)
+		{
+			// last frame's survivors in last frame's order, then the newcomers
+			for (int i = 0; i < count; i++)
+				lookup[slot[i]] = i;
+			order.clear();
+			for (size_t k = 0; k < previousSlot.size(); k++)
+			{
+				int i = lookup[previousSlot[k]];
+				if (i >= 0 && id[i] == previousId[k])
+				{
+					order.push_back(i);
+					lookup[slot[i]] = -1;
+				}
+			}
+			size_t survivors = order.size();
+			for (int i = 0; i < count; i++)
+			{
+				if (lookup[slot[i]] >= 0)
+				{
+					order.push_back(i);
+					lookup[slot[i]] = -1;
+				}
+			}
+
+			full = !repair(survivors, (long long)movesPerParticle * count);
+			if (!full)
+			{
+				std::sort(order.begin() + survivors, order.end(), farther);
+				std::inplace_merge(order.begin(), order.begin() + survivors, order.end(), farther);
+			}
+		}
+		if (full)
+		{
+			order.resize(count);
+			for (int i = 0; i < count; i++)
+				order[i] = i;
+			std::sort(order.begin(), order.end(), farther);
+		}
+
+		previousSlot.resize(count);
+		previousId.resize(count);
+		for (int k = 0; k < count; k++)
+		{
+			previousSlot[k] = slot[order[k]];
+			previousId[k] = id[order[k]];
+		}
+		previousFront = front;
+		return order;
+	}
+
+private:
+	std::vector<int> lookup; // slot to instance, all -1 between sorts
+	std::vector<int> previousSlot;
+	std::vector<unsigned int> previousId;
+	glm::vec3 previousFront;
+	std::vector<float> depth;
+	std::vector<int> order;
+	bool incremental = true;
+	bool full = true;
+	float minTurnCos = 1.0f;
+	int movesPerParticle = 8;
+
+	// insertion sorts the first n of order, false if it takes more than budget moves
+	bool repair(size_t n, long long budget)
+	{
+		long long moves = 0;
+		for (size_t i = 1; i < n; i++)
+		{
+			int v = order[i];
+			float d = depth[v];
+			size_t j = i;
+			while (j > 0 && depth[order[j - 1]] > d)
+			{
+				order[j] = order[j - 1];
+				j--;
+				if (++moves > budget)
+					return false;
+			}
+			order[j] = v;
+		}
+		return true;
+	}
+};
+#endif
@@ -0,0 +1,318 @@
+#ifndef FLUID_H
+#define FLUID_H
+
+/// fluid.h
+/// smoothed particle hydrodynamics for the water. Particles are counting sorted into a
+/// uniform grid of kernel sized cells every substep and kept in that order while the
+/// density, force and integration passes run over the thread pool, so neighbours are read
+/// from contiguous memory. Pressure is a stiff equation of state (Muller et al. 2003) and
+/// the timestep is split into substeps small enough for it to stay stable.
+
+#include <glm/glm.hpp>
+
+#include "threadpool.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+struct FluidSettings
+{
+	float kernelRadius = 0.3f; // also the grid cell size
+	float restDensity = 1000.0f;
+	float particleMass = 3.375f; // rest density at a spacing of half the kernel radius
+	float stiffness = 200.0f; // pressure per unit of density above rest
+	float viscosity = 3.0f;
+	float restitution = 0.3f; // kept of the normal velocity when bouncing off a boundary
+	float courant = 0.4f; // fraction of a kernel radius anything may move in one substep
+	int maxSubsteps = 8; // past this the substeps get longer rather than more numerous
+	glm::vec3 gravity = glm::vec3(0.0f, -9.8f, 0.0f);
+};
+
+class FluidSolver
+{
+public:
+	FluidSolver() {}
+	FluidSolver(const FluidSolver&) = delete;
+	FluidSolver& operator=(const FluidSolver&) = delete;
+
+	// the pool runs every pass, the calling thread takes a share as well
+	// ------------------------------------------------------------------------
+	void init(ThreadPool& pool, const FluidSettings& settings = FluidSettings())
+	{
+		this->pool = &pool;
+		this->settings = settings;
+		const float pi = 3.14159265f;
+		float h = settings.kernelRadius;
+		poly6 = 315.0f / (64.0f * pi * std::pow(h, 9.0f));
+		spikyGrad = -45.0f / (pi * std::pow(h, 6.0f));
+		viscLap = 45.0f / (pi * std::pow(h, 6.0f));
+		soundSpeed = std::sqrt(settings.stiffness);
+	}
+	// box the fluid stays inside, also what the grid covers
+	// ------------------------------------------------------------------------
+	void setBounds(glm::vec3 min, glm::vec3 max)
+	{
+		boundsMin = min;
+		boundsMax = max;
+		glm::vec3 size = (max - min) / settings.kernelRadius;
+		for (int i = 0; i < 3; i++)
+			gridSize[i] = std::max((int)std::ceil(size[i]), 1);
+		cellStart.assign((size_t)gridSize.x * gridSize.y * gridSize.z + 1, 0);
+	}
+	// solid half spheres, flat side up at the centre (the grill), as centre and radius
+	void setBowls(const std::vector<glm::vec4>& centerRadius)
+	{
+		bowls = centerRadius;
+	}
+	// advance count particles by dt. pos and vel are read and written in the caller's order.
+	// ------------------------------------------------------------------------
+	void step(float dt, int count, glm::vec3* pos, glm::vec3* vel)
+	{
+		if (count == 0 || !pool)
+			return;
+		resize(count);
+
+		float maxSpeed = 0.0f;
+		for (int i = 0; i < count; i++)
+			maxSpeed = std::max(maxSpeed, glm::dot(vel[i], vel[i]));
+		maxSpeed = std::sqrt(maxSpeed);
+		float stableStep = settings.courant * settings.kernelRadius / (soundSpeed + maxSpeed);
+		int substeps = std::min(std::max((int)std::ceil(dt / stableStep), 1), settings.maxSubsteps);
+		float substep = dt / substeps;
+		substepsTaken = substeps;
+
+		// sorted copies are worked on in place, order[] maps each back to the caller's index
+		for (int i = 0; i < count; i++)
+			order[i] = i;
+		std::copy(pos, pos + count, sortedPos.begin());
+		std::copy(vel, vel + count, sortedVel.begin());
+		for (int s = 0; s < substeps; s++)
+		{
+			sortIntoGrid(count);
+			computeDensity(count);
+			computeAcceleration(count);
+			integrate(count, substep);
+		}
+		for (int i = 0; i < count; i++)
+		{
+			pos[order[i]] = sortedPos[i];
+			vel[order[i]] = sortedVel[i];
+		}
+	}
+	int lastSubsteps() const
+	{
+		return substepsTaken;
+	}
+	// below what stability asks for the substeps get longer instead, cheaper but less steady
+	void setMaxSubsteps(int substeps)
+	{
+		settings.maxSubsteps = std::max(substeps, 1);
+	}
+
+private:
+	// particles per chunk handed to a worker, small chunks cost more in queueing than they save
+	static const int minChunk = 1024;
+	// neighbours kept per particle, about twice what water squeezed well past rest density has
+	static const int maxNeighbours = 64;
+
+	ThreadPool* pool = NULL;
+	FluidSettings settings;
+	float poly6 = 0.0f, spikyGrad = 0.0f, viscLap = 0.0f, soundSpeed = 0.0f;
+	glm::vec3 boundsMin = glm::vec3(0.0f), boundsMax = glm::vec3(1.0f);
+	glm::ivec3 gridSize = glm::ivec3(1);
+	std::vector<glm::vec4> bowls;
+	int substepsTaken = 0;
+
+	// all indexed by sorted position, except cellStart which is indexed by cell
+	std::vector<int> cellStart; // first particle of each cell, one past the end for the last
+	std::vector<int> cellOf, order, scratchOrder;
+	std::vector<glm::vec3> sortedPos, sortedVel, scratch, acceleration;
+	std::vector<float> density, invDensity, pressure;
+	// found by the density pass for the force pass, maxNeighbours slots per particle
+	std::vector<int> neighbours, numNeighbours;
+
+	void resize(int count)
+	{
+		if ((int)order.size() >= count)
+			return;
+		cellOf.resize(count);
+		order.resize(count);
+		scratchOrder.resize(count);
+		sortedPos.resize(count);
+		sortedVel.resize(count);
+		scratch.resize(count);
+		acceleration.resize(count);
+		density.resize(count);
+		invDensity.resize(count);
+		pressure.resize(count);
+		neighbours.resize((size_t)count * maxNeighbours);
+		numNeighbours.resize(count);
+	}
+	// body(i) for every particle, spread over the pool when there are enough of them
+	template<class F>
+	void forEach(int count, F body)
+	{
+		int numChunks = std::max(std::min((int)pool->size() + 1, count / minChunk), 1);
+		int chunkSize = (count + numChunks - 1) / numChunks;
+		pool->parallelFor(0, numChunks, [&](int begin, int end) {
+			for (int c = begin; c < end; c++)
+			{
+				int last = std::min((c + 1) * chunkSize, count);
+				for (int i = c * chunkSize; i < last; i++)
+					body(i);
+			}
+		});
+	}
+
+	glm::ivec3 cellCoord(glm::vec3 p) const
+	{
+		glm::ivec3 c = glm::ivec3(glm::floor((p - boundsMin) / settings.kernelRadius));
+		return glm::clamp(c, glm::ivec3(0), gridSize - 1);
+	}
+	int cellIndex(glm::ivec3 c) const
+	{ // x fastest, so cells next to each other in x are next to each other in memory
+		return (c.z * gridSize.y + c.y) * gridSize.x + c.x;
+	}
+
+	// counting sort by cell. The particles are nearly in order from the last substep, so this
+	// mostly copies memory straight across.
+	// ------------------------------------------------------------------------
+	void sortIntoGrid(int count)
+	{
+		forEach(count, [&](int i) {
+			cellOf[i] = cellIndex(cellCoord(sortedPos[i]));
+		});
+		int numCells = (int)cellStart.size() - 1;
+		std::fill(cellStart.begin(), cellStart.end(), 0);
+		for (int i = 0; i < count; i++)
+			cellStart[cellOf[i] + 1]++;
+		for (int c = 0; c < numCells; c++)
+			cellStart[c + 1] += cellStart[c];
+		// cellStart doubles as the write cursor, so it ends up one cell ahead and is shifted back
+		for (int i = 0; i < count; i++)
+		{
+			int to = cellStart[cellOf[i]]++;
+			scratch[to] = sortedPos[i];
+			scratchOrder[to] = order[i];
+			acceleration[to] = sortedVel[i];
+		}
+		for (int c = numCells; c > 0; c--)
+			cellStart[c] = cellStart[c - 1];
+		cellStart[0] = 0;
+		sortedPos.swap(scratch);
+		sortedVel.swap(acceleration);
+		order.swap(scratchOrder);
+	}
+
+	// calls body(j) for every particle in the 27 cells around p. The three cells of each x row
+	// are contiguous in the sorted order, so that is nine ranges rather than 27.
+	template<class F>
+	void forNeighbours(glm::vec3 p, F body) const
+	{
+		glm::ivec3 c = cellCoord(p);
+		int x0 = std::max(c.x - 1, 0), x1 = std::min(c.x + 1, gridSize.x - 1);
+		for (int z = std::max(c.z - 1, 0); z <= std::min(c.z + 1, gridSize.z - 1); z++)
+		{
+			for (int y = std::max(c.y - 1, 0); y <= std::min(c.y + 1, gridSize.y - 1); y++)
+			{
+				int begin = cellStart[cellIndex(glm::ivec3(x0, y, z))];
+				int end = cellStart[cellIndex(glm::ivec3(x1, y, z)) + 1];
+				for (int j = begin; j < end; j++)
+					body(j);
+			}
+		}
+	}
+
+	// also records each particle's neighbours, the force pass only visits those
+	void computeDensity(int count)
+	{
+		float h2 = settings.kernelRadius * settings.kernelRadius;
+		forEach(count, [&](int i) {
+			glm::vec3 p = sortedPos[i];
+			int* found = &neighbours[(size_t)i * maxNeighbours];
+			int numFound = 0;
+			float sum = h2 * h2 * h2; // itself
+			forNeighbours(p, [&](int j) {
+				glm::vec3 d = sortedPos[j] - p;
+				float r2 = glm::dot(d, d);
+				if (r2 < h2 && j != i)
+				{
+					float w = h2 - r2;
+					sum += w * w * w;
+					if (numFound < maxNeighbours)
+						found[numFound++] = j;
+				}
+			});
+			numNeighbours[i] = numFound;
+			density[i] = settings.particleMass * poly6 * sum;
+			invDensity[i] = 1.0f / density[i];
+			// no negative pressure, a sparse spray shouldn't pull itself into clumps
+			pressure[i] = settings.stiffness * std::max(density[i] - settings.restDensity, 0.0f);
+		});
+	}
+
+	void computeAcceleration(int count)
+	{
+		float h = settings.kernelRadius;
+		forEach(count, [&](int i) {
+			glm::vec3 p = sortedPos[i], v = sortedVel[i];
+			float pi = pressure[i];
+			glm::vec3 pressureForce = glm::vec3(0.0f), viscosityForce = glm::vec3(0.0f);
+			const int* found = &neighbours[(size_t)i * maxNeighbours];
+			for (int n = 0; n < numNeighbours[i]; n++)
+			{
+				int j = found[n];
+				glm::vec3 d = p - sortedPos[j];
+				float r = std::sqrt(glm::dot(d, d));
+				float q = h - r;
+				float invDensityJ = invDensity[j];
+				if (r > 1e-6f)
+					pressureForce -= d * ((pi + pressure[j]) * 0.5f * invDensityJ * spikyGrad * q * q / r);
+				viscosityForce += (sortedVel[j] - v) * (invDensityJ * viscLap * q);
+			}
+			acceleration[i] = settings.gravity + (pressureForce + settings.viscosity * viscosityForce) * (settings.particleMass * invDensity[i]);
+		});
+	}
+
+	void integrate(int count, float dt)
+	{
+		forEach(count, [&](int i) {
+			glm::vec3 v = sortedVel[i] + acceleration[i] * dt;
+			glm::vec3 p = sortedPos[i] + v * dt;
+			for (int a = 0; a < 3; a++)
+			{
+				if (p[a] < boundsMin[a])
+				{
+					p[a] = boundsMin[a];
+					v[a] = -v[a] * settings.restitution;
+				}
+				else if (p[a] > boundsMax[a])
+				{
+					p[a] = boundsMax[a];
+					v[a] = -v[a] * settings.restitution;
+				}
+			}
+			for (const glm::vec4& b : bowls)
+			{
+				glm::vec3 off = p - glm::vec3(b);
+				float dist2 = glm::dot(off, off);
+				if (p.y >= b.y || dist2 >= b.w * b.w || dist2 < 1e-12f)
+					continue;
+				// just under the flat top lands on it, anything deeper came through the side
+				bool top = p.y > b.y - 0.05f;
+				glm::vec3 n = top ? glm::vec3(0.0f, 1.0f, 0.0f) : off / std::sqrt(dist2);
+				if (top)
+					p.y = b.y;
+				else
+					p = glm::vec3(b) + n * b.w;
+				float into = glm::dot(v, n);
+				if (into < 0.0f)
+					v -= n * into * (1.0f + settings.restitution);
+			}
+			sortedPos[i] = p;
+			sortedVel[i] = v;
+		});
+	}
+};
+#endif
@@ -0,0 +1,126 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+/// governor.h
+/// holds a frame time target by trading quality for speed. A scene describes its quality as
+/// a ladder of levels, best first, and feeds in what each frame cost: the larger of its CPU
+/// and GPU time, so time spent waiting for vsync doesn't count. When the smoothed cost stays
+/// over the target the governor steps down the ladder, when it stays well under it steps back
+/// up. Stepping down is quick and stepping up slow, and a level that has to be left again soon
+/// after it was tried waits twice as long for its next try, so it settles rather than flickers.
+
+#include <math.h>
+
+#include <algorithm>
+
+class QualityGovernor
+{
+public:
+	QualityGovernor() {}
+
+	// levels on the ladder, 0 the best. A target of 0 or less leaves it off, at level 0.
+	// ------------------------------------------------------------------------
+	void init(double targetSeconds, int levels)
+	{
+		target = targetSeconds;
+		count = std::max(levels, 1);
+		on = target > 0.0;
+		current = 0;
+		primed = false;
+		over = under = 0.0;
+		sinceChange = settleSeconds;
+		lastWasUp = false;
+		upWait = minUpWait;
+	}
+	bool enabled() const
+	{
+		return on;
+	}
+	// one frame: cost is the work it took, elapsed the wall time since the one before. True when
+	// the level has changed and the scene should apply it.
+	// ------------------------------------------------------------------------
+	bool update(double cost, double elapsed)
+	{
+		if (!on || elapsed <= 0.0)
+			return false;
+		double a = 1.0 - exp(-elapsed / smoothingSeconds);
+		smoothed = primed ? smoothed + (cost - smoothed) * a : cost;
+		primed = true;
+
+		sinceChange += elapsed;
+		if (sinceChange < settleSeconds)
+			return false; // the last change hasn't shown in the average yet
+		if (lastWasUp && sinceChange >= holdSeconds)
+			upWait = minUpWait; // the step up held
+
+		if (smoothed > target)
+		{
+			over += elapsed;
+			under = 0.0;
+		}
+		else if (smoothed < target * upRatio)
+		{
+			under += elapsed;
+			over = 0.0;
+		}
+		else
+		{
+			over = under = 0.0;
+		}
+
+		if (over >= downAfter && current < count - 1)
+		{
+			if (lastWasUp && sinceChange < holdSeconds)
+				upWait = upWait * 2.0 < maxUpWait ? upWait * 2.0 : maxUpWait; // the better level couldn't hold
+			return change(current + 1, false);
+		}
+		if (under >= upWait && current > 0)
+			return change(current - 1, true);
+		return false;
+	}
+
+	int level() const
+	{
+		return current;
+	}
+	int levels() const
+	{
+		return count;
+	}
+	double smoothedSeconds() const
+	{
+		return smoothed;
+	}
+	double targetSeconds() const
+	{
+		return target;
+	}
+
+private:
+	static constexpr double smoothingSeconds = 0.1; // time constant of the cost's moving average
+	static constexpr double settleSeconds = 0.5; // ignored after a change, while it takes effect
+	static constexpr double downAfter = 0.25; // over the target this long steps down
+	static constexpr double upRatio = 0.7; // under this much of the target counts as headroom
+	static constexpr double minUpWait = 2.0, maxUpWait = 32.0; // headroom needed to step up
+	static constexpr double holdSeconds = 4.0; // a step up undone sooner than this failed
+
+	bool on = false;
+	double target = 0.0;
+	int current = 0, count = 1;
+	double smoothed = 0.0;
+	bool primed = false;
+	double over = 0.0, under = 0.0; // seconds the cost has been over the target, or well under
+	double sinceChange = 0.0;
+	bool lastWasUp = false;
+	double upWait = minUpWait;
+
+	bool change(int level, bool up)
+	{
+		current = level;
+		lastWasUp = up;
+		sinceChange = 0.0;
+		over = under = 0.0;
+		return true;
+	}
+};
+#endif
@@ -0,0 +1,18 @@
+#version 330 core
+// particle layers per pixel, blue through green, yellow and red to white at maxLayers
+out vec4 FragColor;
+
+uniform sampler2D layers;
+uniform float maxLayers;
+uniform vec2 screenSize;
+
+void main()
+{
+	float count = texture(layers, gl_FragCoord.xy / screenSize).r;
+	if (count < 0.5)
+		discard;
+	float t = clamp(count / maxLayers, 0.0, 1.0) * 4.0;
+	vec3 ramp[5] = vec3[](vec3(0.0, 0.0, 1.0), vec3(0.0, 1.0, 0.0), vec3(1.0, 1.0, 0.0), vec3(1.0, 0.0, 0.0), vec3(1.0, 1.0, 1.0));
+	int i = min(int(t), 3);
+	FragColor = vec4(mix(ramp[i], ramp[i + 1], t - float(i)), 0.75);
+}
@@ -0,0 +1,282 @@
+#ifndef HUGEPAGEARENA_H
+#define HUGEPAGEARENA_H
+
+/// hugepagearena.h
+/// one block of memory for the big particle arrays, backed by huge pages where the system
+/// will give them, so passes over hundreds of megabytes of particles take far fewer TLB
+/// misses. On Linux it tries explicit huge pages (MAP_HUGETLB), then transparent ones
+/// (madvise MADV_HUGEPAGE); on Windows large pages, which need the "Lock pages in memory"
+/// right. Otherwise it quietly uses ordinary pages. report() says what was actually obtained.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <new>
+#include <iostream>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "advapi32.lib")
+#endif
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+class HugePageArena
+{
+public:
+	enum Backing { NONE = 0, SMALL_PAGES, TRANSPARENT_HUGE_PAGES, HUGE_PAGES };
+
+	HugePageArena() {}
+	explicit HugePageArena(size_t bytes)
+	{
+		init(bytes);
+	}
+	~HugePageArena()
+	{
+		release();
+	}
+	HugePageArena(const HugePageArena&) = delete;
+	HugePageArena& operator=(const HugePageArena&) = delete;
+
+	// reserves at least bytes for allocate to hand out, false if even ordinary pages fail
+	// ------------------------------------------------------------------------
+	bool init(size_t bytes)
+	{
+		release();
+		requested = bytes;
+#ifdef _WIN32
+		SIZE_T large = GetLargePageMinimum();
+		if (large > 0 && enableLockMemory())
+		{
+			size_t size = roundUp(bytes, large);
+			base = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (base)
+				return obtained(size, large, HUGE_PAGES);
+		}
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		size_t size = roundUp(bytes, info.dwPageSize);
+		base = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (base)
+			return obtained(size, info.dwPageSize, SMALL_PAGES);
+#else
+		size_t small = (size_t)sysconf(_SC_PAGESIZE);
+#ifdef __linux__
+		size_t huge = systemHugePageSize();
+		size_t size = roundUp(bytes, huge);
+		void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (block != MAP_FAILED)
+		{
+			base = block;
+			return obtained(size, huge, HUGE_PAGES);
+		}
+		// no reserved huge pages, ask for transparent ones on a block aligned to them
+		block = mmap(NULL, size + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block != MAP_FAILED)
+		{
+			uintptr_t start = roundUp((uintptr_t)block, huge);
+			size_t before = start - (uintptr_t)block;
+			if (before > 0)
+				munmap(block, before);
+			munmap((char*)start + size, huge - before);
+			base = (void*)start;
+			bool advised = madvise(base, size, MADV_HUGEPAGE) == 0;
+			return obtained(size, advised ? huge : small, advised ? TRANSPARENT_HUGE_PAGES : SMALL_PAGES);
+		}
+#else
+		size_t size = roundUp(bytes, small);
+		void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block != MAP_FAILED)
+		{
+			base = block;
+			return obtained(size, small, SMALL_PAGES);
+		}
+#endif
+#endif
+		return false;
+	}
+	// bytes from the arena, NULL once it is used up (or was never made)
+	// ------------------------------------------------------------------------
+	void* allocate(size_t bytes, size_t alignment = 64)
+	{
+		size_t start = roundUp(used, alignment);
+		if (!base || start + bytes > capacity)
+			return NULL;
+		used = start + bytes;
+		return (char*)base + start;
+	}
+	// a T made in the arena, or on the heap if it doesn't fit. Never destroyed, like the
+	// globals these replace.
+	template<class T>
+	T* create()
+	{
+		void* memory = allocate(sizeof(T), alignof(T) > 64 ? alignof(T) : 64);
+		if (!memory)
+		{
+			spilled += sizeof(T);
+			return new T();
+		}
+		return new (memory) T();
+	}
+	template<class T>
+	T* createArray(size_t count)
+	{
+		void* memory = allocate(sizeof(T) * count, alignof(T) > 64 ? alignof(T) : 64);
+		if (!memory)
+		{
+			spilled += sizeof(T) * count;
+			return new T[count]();
+		}
+		T* items = (T*)memory;
+		for (size_t i = 0; i < count; i++)
+			new (items + i) T();
+		return items;
+	}
+
+	Backing backing() const
+	{
+		return kind;
+	}
+	size_t pageSize() const
+	{
+		return page;
+	}
+	// prints what kind of pages were obtained, for the startup log. Transparent huge pages
+	// are only a request, so on Linux the kernel's count of what it actually backed is added.
+	// ------------------------------------------------------------------------
+	void report(const char* name) const
+	{
+		std::cout << name << ": " << (capacity >> 10) << " KiB for " << (requested >> 10) << " KiB requested, ";
+		switch (kind)
+		{
+		case HUGE_PAGES: std::cout << "huge pages of " << (page >> 10) << " KiB"; break;
+		case TRANSPARENT_HUGE_PAGES: std::cout << "transparent huge pages of " << (page >> 10) << " KiB requested"; break;
+		case SMALL_PAGES: std::cout << "ordinary pages of " << (page >> 10) << " KiB (no huge pages available)"; break;
+		default: std::cout << "not allocated, using the heap"; break;
+		}
+#ifdef __linux__
+		if (kind == TRANSPARENT_HUGE_PAGES)
+		{
+			long backed = transparentHugeKiB();
+			if (backed >= 0)
+				std::cout << ", " << backed << " KiB backed so far";
+		}
+#endif
+		if (spilled > 0)
+			std::cout << ", " << (spilled >> 10) << " KiB didn't fit and went on the heap";
+		std::cout << std::endl;
+	}
+
+private:
+	void* base = NULL;
+	size_t capacity = 0, used = 0, requested = 0, spilled = 0;
+	size_t page = 0;
+	Backing kind = NONE;
+
+	static size_t roundUp(size_t n, size_t to)
+	{
+		return (n + to - 1) / to * to;
+	}
+	bool obtained(size_t size, size_t pageSize, Backing backing)
+	{
+		capacity = size;
+		page = pageSize;
+		kind = backing;
+		used = 0;
+		return true;
+	}
+	void release()
+	{
+		if (base)
+		{
+#ifdef _WIN32
+			VirtualFree(base, 0, MEM_RELEASE);
+#else
+			munmap(base, capacity);
+#endif
+		}
+		base = NULL;
+		capacity = used = spilled = 0;
+		page = 0;
+		kind = NONE;
+	}
+
+#ifdef _WIN32
+	// large pages are refused unless the process holds SeLockMemoryPrivilege and enables it
+	static bool enableLockMemory()
+	{
+		HANDLE token;
+		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+			return false;
+		TOKEN_PRIVILEGES privileges;
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		bool ok = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+			&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+			&& GetLastError() == ERROR_SUCCESS; // not ERROR_NOT_ALL_ASSIGNED
+		CloseHandle(token);
+		return ok;
+	}
+#endif
+#ifdef __linux__
+	// the default huge page size from /proc/meminfo, 2 MiB if it can't be read
+	static size_t systemHugePageSize()
+	{
+		size_t size = 2 << 20;
+		FILE* file = fopen("/proc/meminfo", "r");
+		if (!file)
+			return size;
+		char line[256];
+		unsigned long kib;
+		while (fgets(line, sizeof(line), file))
+		{
+			if (sscanf(line, "Hugepagesize: %lu kB", &kib) == 1)
+			{
+				size = (size_t)kib << 10;
+				break;
+			}
+		}
+		fclose(file);
+		return size;
+	}
+	// AnonHugePages of this arena's mapping in /proc/self/smaps, -1 if it can't be found
+	long transparentHugeKiB() const
+	{
+		FILE* file = fopen("/proc/self/smaps", "r");
+		if (!file)
+			return -1;
+		char line[512];
+		bool inArena = false;
+		long kib = -1;
+		while (fgets(line, sizeof(line), file))
+		{
+			unsigned long start, end;
+			if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+			{
+				inArena = start <= (uintptr_t)base && (uintptr_t)base < end;
+				continue;
+			}
+			long value;
+			if (inArena && sscanf(line, "AnonHugePages: %ld kB", &value) == 1)
+			{
+				kib = (kib < 0 ? 0 : kib) + value;
+			}
+		}
+		fclose(file);
+		return kib;
+	}
+#endif
+};
+#endif
@@ -0,0 +1,216 @@
+#ifndef MESH_H
+#define MESH_H
+
+/// mesh.h
+/// primitive meshes built at compile time, and a gl mesh holding several levels of detail
+/// in one vertex/index buffer pair. Indices are 16 bit, so every level must stay under
+/// 65536 vertices.
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+
+namespace MeshMath
+{
+	constexpr double PI = 3.14159265358979323846;
+
+	// sin/cos usable in constant expressions: reduce to [-pi, pi], then a Taylor series
+	constexpr double sin(double x)
+	{
+		while (x > PI)
+			x -= 2.0 * PI;
+		while (x < -PI)
+			x += 2.0 * PI;
+		double term = x, sum = x;
+		for (int n = 1; n < 12; n++)
+		{
+			term *= -x * x / ((2.0 * n) * (2.0 * n + 1.0));
+			sum += term;
+		}
+		return sum;
+	}
+	constexpr double cos(double x)
+	{
+		return sin(x + PI / 2.0);
+	}
+}
+
+// unit uv sphere, or a band of one, positions only (on a unit sphere they double as normals)
+template<int Slices, int Stacks>
+struct SphereMesh
+{
+	static const int numVertices = (Slices + 1) * (Stacks + 1);
+	static const int numIndices = Slices * Stacks * 6;
+	static_assert(numVertices <= 65536, "sphere too fine for 16 bit indices");
+
+	float vertices[numVertices * 3];
+	unsigned short indices[numIndices];
+};
+
+// stacks run from fromPhi to toPhi, measured down from the top pole
+template<int Slices, int Stacks>
+constexpr SphereMesh<Slices, Stacks> makeSphere(double fromPhi = 0.0, double toPhi = MeshMath::PI)
+{
+	SphereMesh<Slices, Stacks> mesh = {};
+	for (int y = 0; y <= Stacks; y++)
+	{
+		double phi = fromPhi + (toPhi - fromPhi) * y / Stacks; // 0 at the top pole
+		for (int x = 0; x <= Slices; x++)
+		{
+			double theta = 2.0 * MeshMath::PI * x / Slices;
+			int index = (y * (Slices + 1) + x) * 3;
+			mesh.vertices[index] = (float)(MeshMath::cos(theta) * MeshMath::sin(phi)); // x pos
+			mesh.vertices[index + 1] = (float)MeshMath::cos(phi); // y pos
+			mesh.vertices[index + 2] = (float)(MeshMath::sin(theta) * MeshMath::sin(phi)); // z pos
+		}
+	}
+	for (int y = 0; y < Stacks; y++)
+	{
+		for (int x = 0; x < Slices; x++)
+		{
+			int index = (y * Slices + x) * 6;
+			unsigned short topLeft = (unsigned short)(y * (Slices + 1) + x);
+			unsigned short bottomLeft = (unsigned short)((y + 1) * (Slices + 1) + x);
+			mesh.indices[index] = topLeft;					// 0
+			mesh.indices[index + 1] = bottomLeft;			// |
+			mesh.indices[index + 2] = bottomLeft + 1;		// 0--0
+
+			mesh.indices[index + 3] = topLeft;				// 0--0
+			mesh.indices[index + 4] = bottomLeft + 1;		//  \ |
+			mesh.indices[index + 5] = topLeft + 1;			//    0
+		}
+	}
+	return mesh;
+}
+
+// lower half of the unit sphere, a bowl with its rim on y = 0
+template<int Slices, int Stacks>
+constexpr SphereMesh<Slices, Stacks> makeBowl()
+{
+	return makeSphere<Slices, Stacks>(MeshMath::PI / 2.0, MeshMath::PI);
+}
+
+// unit cube centered on the origin, 4 vertices per face so faces can be textured later
+struct BoxMesh
+{
+	static const int numVertices = 24;
+	static const int numIndices = 36;
+
+	float vertices[numVertices * 3];
+	unsigned short indices[numIndices];
+};
+
+constexpr BoxMesh makeBox()
+{
+	BoxMesh mesh = {};
+	// each face: the axis it faces along, then the two axes it spans
+	const int faceAxes[6][3] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 2, 0 }, { 1, 0, 2 }, { 2, 0, 1 }, { 2, 1, 0 } };
+	for (int face = 0; face < 6; face++)
+	{
+		float side = (face % 2 == 0) ? 0.5f : -0.5f;
+		for (int corner = 0; corner < 4; corner++)
+		{
+			int index = (face * 4 + corner) * 3;
+			mesh.vertices[index + faceAxes[face][0]] = side;
+			mesh.vertices[index + faceAxes[face][1]] = (corner & 1) ? 0.5f : -0.5f;
+			mesh.vertices[index + faceAxes[face][2]] = (corner & 2) ? 0.5f : -0.5f;
+		}
+		const unsigned short quad[6] = { 0, 1, 3, 0, 3, 2 };
+		for (int i = 0; i < 6; i++)
+			mesh.indices[face * 6 + i] = (unsigned short)(face * 4 + quad[i]);
+	}
+	return mesh;
+}
+
+// radius in pixels a sphere of this size covers on screen
+inline float projectedRadius(const glm::vec3& center, float radius, const glm::vec3& cameraPos, const glm::mat4& projection, float viewportHeight)
+{
+	float dist = std::max(glm::length(center - cameraPos), 0.001f);
+	return radius / dist * projection[1][1] * viewportHeight * 0.5f;
+}
+
+// gl buffers for one mesh at several levels of detail, finest first. Levels share one
+// VAO and are drawn with a base vertex so switching level is just a different range.
+class LodMesh
+{
+public:
+	unsigned int VAO = 0;
+
+	// level is used while the mesh covers at least minScreenRadius pixels. Add finest first.
+	void addLevel(const float* vertices, int numVertices, const unsigned short* indices, int numIndices, float minScreenRadius)
+	{
+		Level level;
+		level.baseVertex = (GLint)(vertexData.size() / 3);
+		level.firstIndex = (int)indexData.size();
+		level.numIndices = numIndices;
+		level.minScreenRadius = minScreenRadius;
+		levels.push_back(level);
+		vertexData.insert(vertexData.end(), vertices, vertices + numVertices * 3);
+		indexData.insert(indexData.end(), indices, indices + numIndices);
+	}
+	template<class Mesh>
+	void addLevel(const Mesh& mesh, float minScreenRadius)
+	{
+		addLevel(mesh.vertices, Mesh::numVertices, mesh.indices, Mesh::numIndices, minScreenRadius);
+	}
+	// create the gl objects, call once after every level is added
+	void upload()
+	{
+		glGenVertexArrays(1, &VAO);
+		glBindVertexArray(VAO);
+		glGenBuffers(1, &VBO);
+		glBindBuffer(GL_ARRAY_BUFFER, VBO);
+		glBufferData(GL_ARRAY_BUFFER, vertexData.size() * sizeof(float), vertexData.data(), GL_STATIC_DRAW);
+		glGenBuffers(1, &EBO);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexData.size() * sizeof(unsigned short), indexData.data(), GL_STATIC_DRAW);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0); // pos
+		glEnableVertexAttribArray(0);
+		glBindVertexArray(0);
+		// gpu has its copy now
+		std::vector<float>().swap(vertexData);
+		std::vector<unsigned short>().swap(indexData);
+	}
+	// coarsest level whose threshold the on-screen radius still meets
+	int selectLevel(float screenRadius) const
+	{
+		for (int i = 0; i < (int)levels.size(); i++)
+		{
+			if (screenRadius >= levels[i].minScreenRadius)
+				return i;
+		}
+		return (int)levels.size() - 1;
+	}
+	void draw(int level) const
+	{
+		const Level& l = levels[level];
+		glBindVertexArray(VAO);
+		glDrawElementsBaseVertex(GL_TRIANGLES, l.numIndices, GL_UNSIGNED_SHORT, (void*)(l.firstIndex * sizeof(unsigned short)), l.baseVertex);
+	}
+	int numLevels() const
+	{
+		return (int)levels.size();
+	}
+
+private:
+	struct Level
+	{
+		GLint baseVertex;
+		int firstIndex, numIndices;
+		float minScreenRadius;
+	};
+	unsigned int VBO = 0, EBO = 0;
+	std::vector<Level> levels;
+	std::vector<float> vertexData;
+	std::vector<unsigned short> indexData;
+};
+
+// the grill, a bowl open at the top, generated by the compiler
+constexpr SphereMesh<48, 12> bowlLod0 = makeBowl<48, 12>();
+constexpr SphereMesh<24, 6> bowlLod1 = makeBowl<24, 6>();
+constexpr SphereMesh<12, 3> bowlLod2 = makeBowl<12, 3>();
+constexpr SphereMesh<6, 2> bowlLod3 = makeBowl<6, 2>();
+constexpr BoxMesh boxMesh = makeBox();
+#endif
@@ -0,0 +1,203 @@
+#ifndef OFFSCREENPARTICLES_H
+#define OFFSCREENPARTICLES_H
+
+/// offscreenparticles.h
+/// draws the particles into a half or quarter resolution target to cut their blending fill
+/// rate. The opaque scene goes into a full resolution target first, so its depth can be
+/// shrunk to the particle resolution (nearest of each block) and tested against there. The
+/// particles are then composited over the scene with nearest-depth upsampling: bilinear
+/// where the low resolution depth agrees with the scene, the texel of closest depth along
+/// silhouettes so smoke neither bleeds over the grill nor leaves a gap around it.
+
+#include <glad/glad.h>
+
+#include "assets.h"
+#include "shader.h"
+
+#include <iostream>
+
+class OffscreenParticles
+{
+public:
+	OffscreenParticles() {}
+	OffscreenParticles(const OffscreenParticles&) = delete;
+	OffscreenParticles& operator=(const OffscreenParticles&) = delete;
+
+	// programs load with everything else. scale is the divisor of each side of the screen,
+	// 1 leaves the particles at full resolution and none of this is used.
+	// ------------------------------------------------------------------------
+	void init(AssetLoader& assets, int scale, float nearPlane, float farPlane)
+	{
+		this->scale = scale;
+		this->nearPlane = nearPlane;
+		this->farPlane = farPlane;
+		assets.shader(downsampleShader, "fullscreen.vert", "depthdownsample.frag");
+		assets.shader(compositeShader, "fullscreen.vert", "composite.frag");
+		downsampleDepth = downsampleShader.uniform("sceneDepth");
+		downsampleScale = downsampleShader.uniform("scale");
+		compositeParticles = compositeShader.uniform("particles");
+		compositeParticleDepth = compositeShader.uniform("particleDepth");
+		compositeSceneDepth = compositeShader.uniform("sceneDepth");
+		compositeClip = compositeShader.uniform("clipPlanes");
+		// core profile won't draw without a VAO, even though the fullscreen triangle has no attributes
+		glGenVertexArrays(1, &emptyVAO);
+	}
+	// switch between full, half and quarter resolution, targets are rebuilt on the next frame
+	void setScale(int scale)
+	{
+		if (scale != this->scale)
+			width = height = 0;
+		this->scale = scale;
+	}
+	int getScale() const
+	{
+		return scale;
+	}
+	bool enabled() const
+	{
+		return scale > 1;
+	}
+	// redirect the opaque scene into the full resolution target and clear it. Whatever
+	// framebuffer was bound before gets the finished frame from composite().
+	// ------------------------------------------------------------------------
+	bool beginScene(int width, int height)
+	{
+		if (!enabled() || width <= 0 || height <= 0)
+			return false;
+		GLint target = 0;
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+		targetFBO = (unsigned int)target;
+		if ((width != this->width || height != this->height) && !resize(width, height))
+			return false;
+		glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+		glViewport(0, 0, width, height);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		return true;
+	}
+	// shrink the scene depth and leave the low resolution target bound with blending set up
+	// for the particles. Colour accumulates premultiplied, alpha keeps how much of the scene
+	// still shows through.
+	// ------------------------------------------------------------------------
+	void beginParticles()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, particleFBO);
+		glViewport(0, 0, lowWidth, lowHeight);
+		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		glBindVertexArray(emptyVAO);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, sceneDepthTexture);
+		downsampleShader.use();
+		downsampleShader.setInt(downsampleDepth, 2);
+		downsampleShader.setInt(downsampleScale, scale);
+		glDisable(GL_BLEND);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glDepthFunc(GL_ALWAYS);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glDepthFunc(GL_LESS);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+		glEnable(GL_BLEND);
+		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+		glDepthMask(GL_FALSE);
+	}
+	// copy the scene to the original framebuffer and blend the particles over it. Leaves
+	// the usual blending and depth state behind.
+	// ------------------------------------------------------------------------
+	void composite()
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, targetFBO);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+		glViewport(0, 0, width, height);
+
+		glBindVertexArray(emptyVAO);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, sceneDepthTexture);
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, particleColorTexture);
+		glActiveTexture(GL_TEXTURE4);
+		glBindTexture(GL_TEXTURE_2D, particleDepthTexture);
+		compositeShader.use();
+		compositeShader.setInt(compositeSceneDepth, 2);
+		compositeShader.setInt(compositeParticles, 3);
+		compositeShader.setInt(compositeParticleDepth, 4);
+		compositeShader.setVec2(compositeClip, glm::vec2(nearPlane, farPlane));
+		glDisable(GL_DEPTH_TEST);
+		glBlendFunc(GL_ONE, GL_SRC_ALPHA);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glEnable(GL_DEPTH_TEST);
+		glDepthMask(GL_TRUE);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+private:
+	int scale = 1;
+	float nearPlane = 0.1f, farPlane = 100.0f;
+	int width = 0, height = 0, lowWidth = 0, lowHeight = 0;
+	unsigned int targetFBO = 0;
+	unsigned int sceneFBO = 0, sceneColorBuffer = 0, sceneDepthTexture = 0;
+	unsigned int particleFBO = 0, particleColorTexture = 0, particleDepthTexture = 0;
+	unsigned int emptyVAO = 0;
+
+	Shader downsampleShader, compositeShader;
+	Shader::Uniform downsampleDepth, downsampleScale;
+	Shader::Uniform compositeParticles, compositeParticleDepth, compositeSceneDepth, compositeClip;
+
+	static void textureStorage(unsigned int texture, GLint internalFormat, int width, int height, GLenum format, GLenum type, GLint filter)
+	{
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	bool resize(int width, int height)
+	{
+		if (!sceneFBO)
+		{
+			glGenFramebuffers(1, &sceneFBO);
+			glGenRenderbuffers(1, &sceneColorBuffer);
+			glGenTextures(1, &sceneDepthTexture);
+			glGenFramebuffers(1, &particleFBO);
+			glGenTextures(1, &particleColorTexture);
+			glGenTextures(1, &particleDepthTexture);
+		}
+		this->width = width;
+		this->height = height;
+		lowWidth = (width + scale - 1) / scale;
+		lowHeight = (height + scale - 1) / scale;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+		glBindRenderbuffer(GL_RENDERBUFFER, sceneColorBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, sceneColorBuffer);
+		textureStorage(sceneDepthTexture, GL_DEPTH_COMPONENT24, width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_NEAREST);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, sceneDepthTexture, 0);
+		bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, particleFBO);
+		// half float so thin smoke layered many times over doesn't band
+		textureStorage(particleColorTexture, GL_RGBA16F, lowWidth, lowHeight, GL_RGBA, GL_FLOAT, GL_LINEAR);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, particleColorTexture, 0);
+		textureStorage(particleDepthTexture, GL_DEPTH_COMPONENT24, lowWidth, lowHeight, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_NEAREST);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, particleDepthTexture, 0);
+		complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+		if (!complete)
+		{
+			std::cout << "Reduced resolution particle targets are incomplete, drawing particles at full resolution" << std::endl;
+			scale = 1;
+			return false;
+		}
+		return true;
+	}
+};
+#endif
@@ -0,0 +1,8 @@
+#version 330 core
+// one layer for every fragment the particle pass blends, whatever its alpha
+out vec4 FragColor;
+
+void main()
+{
+	FragColor = vec4(1.0);
+}
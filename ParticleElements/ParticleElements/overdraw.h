@@ -0,0 +1,272 @@
+#ifndef OVERDRAW_H
+#define OVERDRAW_H
+
+/// overdraw.h
+/// debug view of particle fill cost. The particles are drawn a second time into a float
+/// target where every fragment adds one, against a copy of the depth the real pass was
+/// tested with, so each pixel ends up holding how many layers were blended into it. The
+/// counts are read back for statistics and shown over the frame as a heat map. With
+/// ARB_pipeline_statistics_query the real pass's fragment shader invocations are counted
+/// by the driver as well.
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "gl_ext.h"
+#include "assets.h"
+#include "shader.h"
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+struct OverdrawStats
+{
+	float mean = 0.0f; // layers per pixel over the whole target
+	float coveredMean = 0.0f; // over pixels with at least one layer
+	int p99 = 0, max = 0; // over pixels with at least one layer
+	float coverage = 0.0f; // fraction of pixels with at least one layer
+	double fragments = 0.0; // sum of every layer
+	double invocations = -1.0; // fragment shader invocations from the pipeline query, -1 without it
+};
+
+class OverdrawView
+{
+public:
+	OverdrawView() {}
+	OverdrawView(const OverdrawView&) = delete;
+	OverdrawView& operator=(const OverdrawView&) = delete;
+
+	// maxLayers is where the heat map turns white. Statistics are printed every reportEvery
+	// measured frames.
+	// ------------------------------------------------------------------------
+	void init(AssetLoader& assets, bool enabled, float maxLayers = 16.0f, int reportEvery = 60)
+	{
+		this->on = enabled;
+		this->maxLayers = maxLayers;
+		this->reportEvery = reportEvery;
+		assets.shader(heatMapShader, "fullscreen.vert", "heatmap.frag");
+		heatMapLayers = heatMapShader.uniform("layers");
+		heatMapMax = heatMapShader.uniform("maxLayers");
+		heatMapSize = heatMapShader.uniform("screenSize");
+		glGenVertexArrays(1, &emptyVAO);
+		if (glExt().pipelineStatistics)
+			glGenQueries(1, &query);
+	}
+	void toggle()
+	{
+		on = !on;
+	}
+	bool enabled() const
+	{
+		return on;
+	}
+	const OverdrawStats& lastStats() const
+	{
+		return stats;
+	}
+	// call with the framebuffer and viewport the particles are about to be drawn into.
+	// Copies its depth before the particles can write to it and starts the fragment query.
+	// ------------------------------------------------------------------------
+	bool begin()
+	{
+		if (!on)
+			return false;
+		GLint target = 0, viewport[4];
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		targetFBO = (unsigned int)target;
+		if (viewport[2] != width || viewport[3] != height || depthFormat(targetFBO) != counterDepthFormat)
+			resize(viewport[2], viewport[3]);
+		if (!on)
+			return false;
+
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, counterFBO);
+		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		if (copyDepth)
+		{
+			while (glGetError() != GL_NO_ERROR) {}
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, targetFBO);
+			glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+			if (glGetError() != GL_NO_ERROR)
+			{
+				std::cout << "Overdraw view can't copy the scene depth, counting layers without occlusion" << std::endl;
+				copyDepth = false;
+				glClear(GL_DEPTH_BUFFER_BIT);
+			}
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+
+		if (query)
+			glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB, query);
+		return true;
+	}
+	// after the real draw: switch to the layer counter. Draw the same instances again with
+	// a program that outputs 1, then call endCount().
+	// ------------------------------------------------------------------------
+	void beginCount()
+	{
+		if (query)
+			glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+		GLint blend[4];
+		glGetIntegerv(GL_BLEND_SRC_RGB, &blend[0]);
+		glGetIntegerv(GL_BLEND_DST_RGB, &blend[1]);
+		glGetIntegerv(GL_BLEND_SRC_ALPHA, &blend[2]);
+		glGetIntegerv(GL_BLEND_DST_ALPHA, &blend[3]);
+		for (int i = 0; i < 4; i++)
+			savedBlend[i] = (GLenum)blend[i];
+		glBindFramebuffer(GL_FRAMEBUFFER, counterFBO);
+		glBlendFunc(GL_ONE, GL_ONE);
+	}
+	// back to the real target with its blending, and gather the statistics
+	// ------------------------------------------------------------------------
+	void endCount()
+	{
+		layers.resize((size_t)width * height);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, counterFBO);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, width, height, GL_RED, GL_FLOAT, layers.data());
+		glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+		glBlendFuncSeparate(savedBlend[0], savedBlend[1], savedBlend[2], savedBlend[3]);
+
+		gather();
+		if (query)
+		{
+			GLuint64 invocations = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &invocations);
+			stats.invocations = (double)invocations;
+		}
+		if (++framesMeasured % reportEvery == 0)
+			report();
+	}
+	// layer counts over whatever is bound, stretched to the viewport
+	// ------------------------------------------------------------------------
+	void drawHeatMap()
+	{
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		glBindVertexArray(emptyVAO);
+		glActiveTexture(GL_TEXTURE5);
+		glBindTexture(GL_TEXTURE_2D, counterTexture);
+		heatMapShader.use();
+		heatMapShader.setInt(heatMapLayers, 5);
+		heatMapShader.setFloat(heatMapMax, maxLayers);
+		heatMapShader.setVec2(heatMapSize, glm::vec2((float)viewport[2], (float)viewport[3]));
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glEnable(GL_DEPTH_TEST);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+private:
+	bool on = false;
+	float maxLayers = 16.0f;
+	int reportEvery = 60, framesMeasured = 0;
+	int width = 0, height = 0;
+	unsigned int targetFBO = 0;
+	unsigned int counterFBO = 0, counterTexture = 0, counterDepth = 0;
+	GLenum counterDepthFormat = 0;
+	bool copyDepth = true;
+	unsigned int emptyVAO = 0, query = 0;
+	GLenum savedBlend[4] = { GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA };
+	std::vector<float> layers;
+	std::vector<int> histogram;
+	OverdrawStats stats;
+
+	Shader heatMapShader;
+	Shader::Uniform heatMapLayers, heatMapMax, heatMapSize;
+
+	// a depth format the target's depth can be blitted into, which needs an exact match
+	static GLenum depthFormat(unsigned int fbo)
+	{
+		GLenum depth = fbo ? GL_DEPTH_ATTACHMENT : GL_DEPTH, stencil = fbo ? GL_STENCIL_ATTACHMENT : GL_STENCIL;
+		GLint depthBits = 0, stencilBits = 0;
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glGetFramebufferAttachmentParameteriv(GL_READ_FRAMEBUFFER, depth, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+		glGetFramebufferAttachmentParameteriv(GL_READ_FRAMEBUFFER, stencil, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+		if (stencilBits > 0)
+			return GL_DEPTH24_STENCIL8;
+		return depthBits == 16 ? GL_DEPTH_COMPONENT16 : GL_DEPTH_COMPONENT24;
+	}
+
+	void resize(int width, int height)
+	{
+		if (!counterFBO)
+		{
+			glGenFramebuffers(1, &counterFBO);
+			glGenTextures(1, &counterTexture);
+			glGenRenderbuffers(1, &counterDepth);
+		}
+		this->width = width;
+		this->height = height;
+		counterDepthFormat = depthFormat(targetFBO);
+		copyDepth = true;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, counterFBO);
+		glBindTexture(GL_TEXTURE_2D, counterTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, counterTexture, 0);
+		glBindRenderbuffer(GL_RENDERBUFFER, counterDepth);
+		glRenderbufferStorage(GL_RENDERBUFFER, counterDepthFormat, width, height);
+		GLenum attachment = counterDepthFormat == GL_DEPTH24_STENCIL8 ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, attachment, GL_RENDERBUFFER, counterDepth);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			std::cout << "Overdraw target is incomplete, turning the overdraw view off" << std::endl;
+			on = false;
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
+	}
+
+	// counts are whole numbers, so a histogram gives the percentile exactly
+	void gather()
+	{
+		histogram.assign(1, 0);
+		double total = 0.0;
+		for (float f : layers)
+		{
+			int n = (int)(f + 0.5f);
+			if (n >= (int)histogram.size())
+				histogram.resize(n + 1, 0);
+			histogram[n]++;
+			total += n;
+		}
+		int numPixels = (int)layers.size();
+		int covered = numPixels - histogram[0];
+		stats.fragments = total;
+		stats.mean = numPixels ? (float)(total / numPixels) : 0.0f;
+		stats.coveredMean = covered ? (float)(total / covered) : 0.0f;
+		stats.coverage = numPixels ? (float)covered / numPixels : 0.0f;
+		stats.max = (int)histogram.size() - 1;
+		// smallest count with at least 99% of the covered pixels at or below it
+		stats.p99 = 0;
+		int below = 0;
+		for (int n = 1; n < (int)histogram.size() && covered > 0; n++)
+		{
+			below += histogram[n];
+			if (below >= covered * 0.99)
+			{
+				stats.p99 = n;
+				break;
+			}
+		}
+	}
+
+	void report() const
+	{
+		std::cout << "Overdraw " << width << "x" << height << ": " << (int)(stats.coverage * 100.0f + 0.5f) << "% covered, mean "
+			<< stats.mean << " layers (" << stats.coveredMean << " where covered), p99 " << stats.p99 << ", max " << stats.max
+			<< ", " << (long long)stats.fragments << " fragments";
+		if (stats.invocations >= 0.0)
+			std::cout << ", " << (long long)stats.invocations << " fragment shader invocations";
+		std::cout << std::endl;
+	}
+};
+#endif
@@ -3,10 +3,11 @@ out vec4 FragColor;
 
 in vec2 TexCoord;
 in vec4 TintColor;
+flat in float SpriteLayer;
 
-uniform sampler2D texture1;
+uniform sampler2DArray sprites;
 
 void main()
 {
-	FragColor = texture(texture1, TexCoord) * TintColor; 
+	FragColor = texture(sprites, vec3(TexCoord, SpriteLayer)) * TintColor; 
 }
\ No newline at end of file
@@ -1,13 +1,22 @@
 #version 330 core
-layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec4 xyzs;
 layout (location = 2) in vec4 color;
+layout (location = 3) in float sprite;
 
 out vec2 TexCoord;
 out vec4 TintColor;
+flat out float SpriteLayer;
 
-uniform mat4 view;
-uniform mat4 projection;
+// corners of every sprite's trimmed outline in texture space, a triangle fan per sprite.
+// Must match OUTLINE_VERTICES in spriteoutline.h and hold NUM_SPRITES outlines.
+const int OUTLINE_VERTICES = 8;
+uniform vec2 outline[2 * OUTLINE_VERTICES];
+
+layout (std140) uniform Camera
+{
+	mat4 view;
+	mat4 projection;
+};
 
 void main()
 {
@@ -16,13 +25,18 @@ void main()
 	vec3 cameraRightWorldSpace = vec3(view[0][0], view[1][0], view[2][0]);
 	vec3 cameraUpWorldSpace = vec3(view[0][1], view[1][1], view[2][1]);
 
+	vec2 uv = outline[int(sprite) * OUTLINE_VERTICES + gl_VertexID];
+	vec2 aPos = uv - vec2(0.5, 0.5);
+
 	vec3 viewPos = xyzs.xyz 
 		+ cameraRightWorldSpace * aPos.x * xyzs.w 
 		+ cameraUpWorldSpace * aPos.y * xyzs.w;
 
 	gl_Position = projection * view * vec4(viewPos, 1.0);
 
-	TexCoord = aPos.xy + vec2(0.5, 0.5);
+	TexCoord = uv;
 
 	TintColor = color;
+
+	SpriteLayer = sprite;
 }
\ No newline at end of file
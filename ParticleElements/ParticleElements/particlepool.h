@@ -0,0 +1,175 @@
+#ifndef PARTICLEPOOL_H
+#define PARTICLEPOOL_H
+
+/// particlepool.h
+/// splits one particle container into a sub-pool per emitter, so each emitter's particles sit
+/// together and can be updated, bounded and culled as a group. The container is cut into
+/// chunks of 64 slots, each with a bit per slot; an emitter owns a list of chunks, takes a
+/// new one from the shared free list when its own are full and hands a chunk back as soon as
+/// it empties. It's plain data so it can live in a scene's snapshot state.
+
+#include <glm/glm.hpp>
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+
+// box around an emitter's particles, empty while min > max
+struct PoolBounds
+{
+	glm::vec3 min, max;
+
+	void clear()
+	{
+		min = glm::vec3(std::numeric_limits<float>::max());
+		max = glm::vec3(-std::numeric_limits<float>::max());
+	}
+	void grow(glm::vec3 pos, float radius)
+	{
+		min = glm::min(min, pos - glm::vec3(radius));
+		max = glm::max(max, pos + glm::vec3(radius));
+	}
+	bool empty() const
+	{
+		return min.x > max.x;
+	}
+};
+
+template<int Slots, int Pools>
+class ParticlePools
+{
+public:
+	static const int chunkSize = 64;
+	static const int numChunks = (Slots + chunkSize - 1) / chunkSize;
+
+	PoolBounds bounds[Pools]; // filled in by whoever moves the particles
+
+	// every slot free and no chunk owned. Only the first capacity slots are handed out.
+	// ------------------------------------------------------------------------
+	void reset(int capacity)
+	{
+		capacity = std::min(std::max(capacity, 0), Slots);
+		int usable = (capacity + chunkSize - 1) / chunkSize;
+		freeChunks = -1;
+		for (int c = numChunks - 1; c >= 0; c--)
+		{
+			owner[c] = -1;
+			next[c] = -1;
+			int unusable = std::min((c + 1) * chunkSize - capacity, (int)chunkSize); // slots past capacity
+			empty[c] = unusable <= 0 ? 0 : unusable >= chunkSize ? ~0ull : ~0ull << (chunkSize - unusable);
+			used[c] = empty[c];
+			if (c >= usable)
+				continue;
+			next[c] = freeChunks;
+			freeChunks = c;
+		}
+		for (int p = 0; p < Pools; p++)
+		{
+			first[p] = -1;
+			bounds[p].clear();
+		}
+	}
+	// a free slot for pool, in one of its own chunks if it has room, -1 if none is left. Once
+	// every chunk is owned a slot is borrowed from another pool's chunk rather than refused, so
+	// the whole capacity stays usable; it is then walked and bounded with that pool.
+	// ------------------------------------------------------------------------
+	int allocate(int pool)
+	{
+		int c = first[pool];
+		while (c >= 0 && used[c] == ~0ull)
+			c = next[c];
+		if (c < 0 && freeChunks >= 0)
+		{ // take a fresh chunk, at the front so it's found first next time
+			c = freeChunks;
+			freeChunks = next[c];
+			owner[c] = pool;
+			next[c] = first[pool];
+			first[pool] = c;
+		}
+		for (int i = 0; c < 0 && i < numChunks; i++)
+		{
+			if (owner[i] >= 0 && used[i] != ~0ull)
+				c = i;
+		}
+		if (c < 0)
+			return -1;
+		int bit = 0;
+		while (used[c] & (1ull << bit))
+			bit++;
+		used[c] |= 1ull << bit;
+		return c * chunkSize + bit;
+	}
+	// gives slot back, and its chunk too once that's empty
+	// ------------------------------------------------------------------------
+	void release(int slot)
+	{
+		int c = slot / chunkSize;
+		used[c] &= ~(1ull << (slot % chunkSize));
+		if (used[c] != empty[c] || owner[c] < 0)
+			return;
+		int* link = &first[owner[c]];
+		while (*link != c)
+			link = &next[*link];
+		*link = next[c];
+		owner[c] = -1;
+		next[c] = freeChunks;
+		freeChunks = c;
+	}
+
+	// walking a pool: for (int c = firstChunk(pool), n; c >= 0; c = n) { n = nextChunk(c); ... }
+	// reads the next chunk before the slots, so releasing them on the way is fine
+	int firstChunk(int pool) const
+	{
+		return first[pool];
+	}
+	int nextChunk(int chunk) const
+	{
+		return next[chunk];
+	}
+	static int chunkBegin(int chunk)
+	{
+		return chunk * chunkSize;
+	}
+	static int chunkEnd(int chunk)
+	{
+		return std::min((chunk + 1) * chunkSize, Slots);
+	}
+
+private:
+	uint64_t used[numChunks]; // a bit per slot
+	uint64_t empty[numChunks]; // used with nothing allocated, the bits past capacity stay set
+	int owner[numChunks]; // pool, -1 while free
+	int next[numChunks]; // next chunk of the same pool, or of the free list
+	int first[Pools];
+	int freeChunks = -1;
+};
+
+// the six planes of a view frustum, pointing inwards with unit length normals
+inline void frustumPlanes(const glm::mat4& m, glm::vec4* planes)
+{
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; i++)
+		rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+	for (int i = 0; i < 3; i++)
+	{
+		planes[2 * i] = rows[3] + rows[i];
+		planes[2 * i + 1] = rows[3] - rows[i];
+	}
+	for (int i = 0; i < 6; i++)
+		planes[i] /= glm::length(glm::vec3(planes[i]));
+}
+
+// false only when the box is wholly outside one of the planes
+inline bool boxInFrustum(const glm::vec4* planes, glm::vec3 min, glm::vec3 max)
+{
+	for (int i = 0; i < 6; i++)
+	{
+		// the corner furthest along the plane's normal
+		glm::vec3 corner(planes[i].x >= 0.0f ? max.x : min.x, planes[i].y >= 0.0f ? max.y : min.y, planes[i].z >= 0.0f ? max.z : min.z);
+		if (glm::dot(glm::vec3(planes[i]), corner) + planes[i].w < 0.0f)
+			return false;
+	}
+	return true;
+}
+#endif
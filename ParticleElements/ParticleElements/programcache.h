@@ -0,0 +1,133 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+/// programcache.h
+/// keeps linked program binaries on disk so later launches can skip compiling. Entries are
+/// keyed by a hash of the shader sources and the driver's vendor, renderer and version
+/// strings, so a driver update or a shader edit just misses the cache.
+
+#include <glad/glad.h>
+
+#include "gl_ext.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace ProgramCache
+{
+	const char* const directory = "shadercache";
+	const uint32_t magic = 0x4E494250; // "PBIN"
+
+	struct Header
+	{
+		uint32_t magic;
+		uint64_t key;
+		uint32_t format;
+		uint32_t length;
+	};
+
+	// 64 bit FNV-1a
+	inline uint64_t hash(const char* data, size_t length, uint64_t h = 14695981039346656037ULL)
+	{
+		for (size_t i = 0; i < length; i++)
+		{
+			h ^= (unsigned char)data[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	inline uint64_t key(const std::string& vertexCode, const std::string& fragmentCode)
+	{
+		const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		uint64_t h = hash(vertexCode.data(), vertexCode.size());
+		h = hash("\0", 1, h); // keep "ab"+"c" and "a"+"bc" apart
+		h = hash(fragmentCode.data(), fragmentCode.size(), h);
+		for (GLenum name : driverStrings)
+		{
+			const char* str = (const char*)glGetString(name);
+			if (str)
+				h = hash(str, strlen(str), h);
+			h = hash("\0", 1, h);
+		}
+		return h;
+	}
+
+	inline std::string path(uint64_t key)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+		return std::string(directory) + name;
+	}
+
+	// returns true if program now holds a linked binary. A rejected binary (driver
+	// changed its mind, truncated file) leaves program unlinked for a normal compile.
+	inline bool load(GLuint program, uint64_t key)
+	{
+		if (!glExt().programBinary)
+			return false;
+		std::ifstream file(path(key), std::ios::binary);
+		if (!file)
+			return false;
+		Header header;
+		if (!file.read((char*)&header, sizeof(header)) || header.magic != magic || header.key != key)
+			return false;
+		std::vector<char> binary(header.length);
+		if (!file.read(binary.data(), header.length))
+			return false;
+
+		glExt().ProgramBinary(program, header.format, binary.data(), (GLsizei)header.length);
+		GLint success = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &success);
+		return success == GL_TRUE;
+	}
+
+	// mark a program as retrievable, call before glLinkProgram
+	inline void prepare(GLuint program)
+	{
+		if (glExt().programBinary)
+			glExt().ProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
+	// write a successfully linked program out for next time
+	inline void store(GLuint program, uint64_t key)
+	{
+		if (!glExt().programBinary)
+			return;
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+		std::vector<char> binary(length);
+		Header header;
+		header.magic = magic;
+		header.key = key;
+		GLenum format = 0;
+		GLsizei written = 0;
+		glExt().GetProgramBinary(program, length, &written, &format, binary.data());
+		header.format = format;
+		header.length = (uint32_t)written;
+
+#ifdef _WIN32
+		_mkdir(directory);
+#else
+		mkdir(directory, 0755);
+#endif
+		std::ofstream file(path(key), std::ios::binary | std::ios::trunc);
+		if (!file)
+			return;
+		file.write((const char*)&header, sizeof(header));
+		file.write(binary.data(), written);
+	}
+}
+#endif
@@ -0,0 +1,32 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+/// random.h
+/// small seedable generator. Its whole state is one integer, so it can be saved and
+/// restored along with the rest of the simulation (rand() can't).
+
+#include <stdint.h>
+
+struct Rng
+{
+	uint64_t state = 0x853c49e6748fea9bULL;
+
+	void seed(uint64_t s)
+	{
+		state = s ? s : 0x853c49e6748fea9bULL; // xorshift never leaves 0
+	}
+	// xorshift64*, upper 32 bits
+	uint32_t next()
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return (uint32_t)((state * 0x2545F4914F6CDD1DULL) >> 32);
+	}
+	// uniform in [0, 1)
+	float uniform()
+	{
+		return (next() >> 8) * (1.0f / 16777216.0f);
+	}
+};
+#endif
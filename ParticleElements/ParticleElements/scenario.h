@@ -0,0 +1,185 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+/// scenario.h
+/// scenario files describe a scene's setup (spawners, presets, capacities, collision and
+/// timeline) so benchmark setups can be shared as files instead of source edits. The text
+/// form is a list of lines, "key value value ..." with blocks closed by "end" and # comments.
+/// Each scene turns the lines into its own plain Scenario struct; that struct is what gets
+/// saved as the compiled form (<file>b next to the text), so later loads are one copy.
+
+#include "mappedfile.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <type_traits>
+#include <iostream>
+
+const uint32_t SCENARIO_MAGIC = 0x424E4353; // "SCNB"
+// bump whenever a scene's Scenario struct changes layout
+const uint32_t SCENARIO_VERSION = 3;
+
+struct ScenarioHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t scene;
+	uint32_t reserved;
+	uint64_t scenarioSize;
+	uint64_t sourceHash; // hash of the text it was compiled from, a stale file is recompiled
+};
+
+struct ScenarioLine
+{
+	int lineNumber;
+	std::vector<std::string> words;
+
+	const std::string& key() const
+	{
+		return words[0];
+	}
+	// reads n numbers starting at word first, complaining if any are missing or malformed
+	bool numbers(size_t first, float* out, int n) const
+	{
+		if (words.size() < first + n)
+			return error("expected " + std::to_string(n) + " number(s)");
+		for (int i = 0; i < n; i++)
+		{
+			const char* word = words[first + i].c_str();
+			char* end;
+			out[i] = strtof(word, &end);
+			if (end == word || *end != '\0')
+				return error("'" + words[first + i] + "' is not a number");
+		}
+		return true;
+	}
+	bool error(const std::string& message) const
+	{
+		std::cout << "Scenario line " << lineNumber << ": " << message << std::endl;
+		return false;
+	}
+};
+
+// splits scenario text into lines of words, dropping comments and blank lines
+inline std::vector<ScenarioLine> splitScenario(const std::string& text)
+{
+	std::vector<ScenarioLine> lines;
+	std::istringstream stream(text);
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(stream, line))
+	{
+		lineNumber++;
+		size_t comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+		ScenarioLine parsed;
+		parsed.lineNumber = lineNumber;
+		std::istringstream words(line);
+		std::string word;
+		while (words >> word)
+			parsed.words.push_back(word);
+		if (!parsed.words.empty())
+			lines.push_back(parsed);
+	}
+	return lines;
+}
+
+inline uint64_t scenarioHash(const std::string& text)
+{
+	uint64_t h = 14695981039346656037ULL; // 64 bit FNV-1a
+	for (char c : text)
+	{
+		h ^= (unsigned char)c;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+template<class Scenario>
+bool saveCompiledScenario(const char* path, uint32_t scene, uint64_t sourceHash, const Scenario& scenario)
+{
+	static_assert(std::is_trivially_copyable<Scenario>::value, "compiled scenario must be plain data");
+	ScenarioHeader header;
+	header.magic = SCENARIO_MAGIC;
+	header.version = SCENARIO_VERSION;
+	header.scene = scene;
+	header.reserved = 0;
+	header.scenarioSize = sizeof(Scenario);
+	header.sourceHash = sourceHash;
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(&scenario, sizeof(Scenario), 1, file) == 1;
+	ok = (fclose(file) == 0) && ok;
+	return ok;
+}
+
+// sourceHash 0 accepts any source, for loading a compiled file on its own
+template<class Scenario>
+bool loadCompiledScenario(const char* path, uint32_t scene, uint64_t sourceHash, Scenario& scenario)
+{
+	static_assert(std::is_trivially_copyable<Scenario>::value, "compiled scenario must be plain data");
+	MappedFile file;
+	if (!file.open(path) || file.size() < sizeof(ScenarioHeader) + sizeof(Scenario))
+		return false;
+	ScenarioHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if (header.magic != SCENARIO_MAGIC || header.version != SCENARIO_VERSION || header.scene != scene
+		|| header.scenarioSize != sizeof(Scenario) || (sourceHash != 0 && header.sourceHash != sourceHash))
+		return false;
+	memcpy(&scenario, file.data() + sizeof(header), sizeof(Scenario));
+	return true;
+}
+
+// loads a text scenario through parse (bool parse(lines, scenario)), reusing its compiled
+// form when that is up to date and writing a fresh one otherwise. A path ending in "b"
+// (foo.scnb) is taken as a compiled file to load directly. scenario is left untouched
+// unless loading succeeds.
+template<class Scenario, class Parse>
+bool loadScenario(const char* path, uint32_t scene, Scenario& scenario, Parse parse)
+{
+	std::string textPath = path;
+	if (!textPath.empty() && textPath.back() == 'b')
+	{
+		if (loadCompiledScenario(path, scene, 0, scenario))
+			return true;
+		std::cout << "Compiled scenario " << path << " doesn't match this build or scene" << std::endl;
+		return false;
+	}
+
+	std::ifstream file(textPath, std::ios::binary);
+	if (!file)
+	{
+		std::cout << "Failed to open scenario " << path << std::endl;
+		return false;
+	}
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	std::string text = buffer.str();
+	uint64_t hash = scenarioHash(text);
+
+	std::string compiledPath = textPath + "b";
+	if (loadCompiledScenario(compiledPath.c_str(), scene, hash, scenario))
+		return true;
+
+	Scenario parsed = scenario; // anything the file doesn't mention keeps its default
+	if (!parse(splitScenario(text), parsed))
+	{
+		std::cout << "Failed to load scenario " << path << std::endl;
+		return false;
+	}
+	scenario = parsed;
+	if (!saveCompiledScenario(compiledPath.c_str(), scene, hash, scenario))
+		std::cout << "Couldn't write compiled scenario " << compiledPath << std::endl;
+	return true;
+}
+#endif
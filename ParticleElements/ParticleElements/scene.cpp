@@ -5,17 +5,55 @@
 #include <GLFW/glfw3.h>
 // shader helper
 #include "shader.h"
+// background loading of textures and shaders
+#include "assets.h"
+#include "threadpool.h"
+// water
+#include "fluid.h"
+// heat and moisture
+#include "voxelfield.h"
+// compile-time primitive meshes
+#include "mesh.h"
+// saving and restoring the simulation
+#include "random.h"
+#include "snapshot.h"
+// recording and replaying particle frames
+#include "recording.h"
+// simulation on its own thread
+#include "simthread.h"
+// scenario files
+#include "scenario.h"
 // math
 #include <stdlib.h>
 #include <math.h>
 #include <algorithm>
 #include <limits>
+#include <cstddef>
+#include <map>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 // image loading
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb/stb_image_write.h>
+// rendering to an image sequence
+#include "framecapture.h"
+// particles at reduced resolution
+#include "offscreenparticles.h"
+// overdraw heat map and statistics
+#include "overdraw.h"
+// back to front order carried over between frames
+#include "depthsort.h"
+// a sub-pool and bounds per emitter
+#include "particlepool.h"
+// huge page backed particle memory
+#include "hugepagearena.h"
+// frame time percentiles for --benchmark
+#include "benchmark.h"
+// quality steps that hold --target-fps
+#include "governor.h"
 
 
 // Functions ---------------------------------
@@ -23,14 +61,78 @@
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
-int findUnusedParticle();
-void sortParticles();
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
+int findUnusedParticle(int pool);
+struct SimInput;
+void stepSimulation(float dt, const SimInput& input, ParticleFrame& frame);
+void spawnParticles(float dt);
+int simulateParticles(float dt);
+void simulateWater(float dt);
+void spreadFire(float dt);
+int cullEmitters(const ParticleFrame& frame, const glm::mat4& viewProjection, std::vector<int>& slot, std::vector<unsigned int>& id, glm::vec4* posSize, glm::vec4* color, float* sprite);
+void sortInstances(int count, const int* slot, const unsigned int* id, glm::vec4* posSize, glm::vec4* color, float* sprite);
+void applyQuality();
+bool waterSource(glm::vec3& origin, glm::vec3& dir);
+struct Particle;
+struct ParticleLook;
+glm::vec4 particleColor(const Particle& p, const ParticleLook& look);
+int internLook(const ParticleLook& look);
+struct Scenario;
+struct ParticleSpawner;
+Scenario defaultScenario();
+bool parseScenario(const std::vector<ScenarioLine>& lines, Scenario& scenario);
+bool parseSpawnerField(const ScenarioLine& line, ParticleSpawner& spawner);
+void applyScenario();
+struct SurfaceInstance;
+SurfaceInstance makeSurface(const glm::mat4& model, glm::vec3 center, glm::vec3 uAxis, glm::vec3 vAxis, glm::vec2 uvRepeat, int layer);
 
 // Global variables ---------------------------
 
 // window
 const int SCR_WIDTH = 1280;
 const int SCR_HEIGHT = 720;
+const float nearPlane = 0.1f, farPlane = 100.0f;
+
+// particle fill rate, --particle-scale 2 or 4 (or P to cycle) draws them at half or quarter
+// resolution and upsamples them over the scene
+OffscreenParticles offscreenParticles;
+int particleScale = 1;
+
+// --overdraw (or O) counts the layers blended into each pixel by the particles, shows them as
+// a heat map and prints mean, p99 and max every second or so
+OverdrawView overdraw;
+bool overdrawAtStart = false;
+
+// instances are drawn back to front, repairing last frame's order unless --full-sort
+DepthSorter depthSorter;
+bool fullSort = false;
+
+// --benchmark 600 (frames) or 30s runs without vsync and prints frame, CPU and GPU time percentiles
+Benchmark benchmark;
+// times every frame, for the benchmark and the governor, while either is on
+FrameTimer frameTimer;
+
+// --target-fps 60 steps down this ladder while frames cost more than 1/60 s and back up when
+// they have room again, printing each change. Water particles are left alone, they put out fires.
+struct QualityLevel {
+	float emission; // fraction of each fire's particles that are spawned
+	float lodScale; // multiplies screen radii when picking mesh levels, lower goes coarse sooner
+	int particleScale; // the particle pass is drawn at 1/particleScale resolution or less
+	int fluidSubsteps; // most substeps the water may split a tick into
+};
+const QualityLevel qualityLevels[] = {
+	{ 1.0f, 1.0f, 1, 8 },
+	{ 1.0f, 0.5f, 1, 8 },
+	{ 1.0f, 0.5f, 2, 8 },
+	{ 0.75f, 0.5f, 2, 6 },
+	{ 0.75f, 0.25f, 4, 6 },
+	{ 0.5f, 0.25f, 4, 4 },
+	{ 0.35f, 0.25f, 4, 3 },
+	{ 0.25f, 0.25f, 4, 2 },
+};
+const int numQualityLevels = sizeof(qualityLevels) / sizeof(qualityLevels[0]);
+QualityGovernor governor;
+double targetFps = 0.0;
 
 // camera
 glm::vec3 cameraPos = glm::vec3(0.0f, 3.0f, 3.0f);
@@ -45,49 +147,228 @@ float deltaTime = 0.0f;	// Time between current frame and last frame
 float lastFrame = 0.0f; // Time of last frame
 
 // particles
+// What every particle of one effect shares, kept once in a palette that particles index into
+struct ParticleLook {
+	glm::vec4 startCol, endCol; // colour fades from one to the other over the particle's life
+	float lifetime, size;
+	int type; // water or fire
+	int sprite; // layer in the sprite texture array
+};
+
 struct Particle { // Struct for cpu - data is pushed into buffers for gpu to use
 	glm::vec3 pos, vel;
-	glm::vec4 col, startCol, endCol;
-	float size, maxLife;
 	float life = -1.0f; // Remaining life of the particle. < 0 = dead/unused.
-	float cameraDist = -INFINITY;
-	int type; // water or fire
-
-	bool operator<(Particle& that)
-	{
-		// Sort in reverse order : far particles drawn first.
-		return this->cameraDist > that.cameraDist;
-	}
+	unsigned int id; // new for every spawn, so a reused slot isn't mistaken for the same particle
+	int8_t tint[4]; // its own variation on the look's start colour, in steps of tintStep
+	uint16_t look; // in the look palette
 };
+const float tintStep = 0.05f / 127.0f; // tints reach +-0.05
 
 
-const int maxParticles = 10000; // This is across all spawners
-Particle particleContainer[maxParticles];
-int lastUsedParticle = 0;
+const int maxParticles = 60000; // This is across all spawners and the water
 
 Particle waterContainer[1000];
 int lastUsedWater = 0;
 
+// particle sprites, one layer each in the sprite texture array so every effect draws in the same call
+enum SpriteLayer { SPRITE_SMOKE = 0, SPRITE_DROPLET, NUM_SPRITES };
+const char* spriteFiles[NUM_SPRITES] = { "smoke1.png", "particle.png" };
+const int spriteSize = 256; // every layer is resampled to this
+
+// static room surfaces, uploaded once and drawn with a single instanced call
+struct SurfaceInstance {
+	glm::mat4 model; // maps the unit quad onto the surface
+	glm::vec4 uvLayer; // uv repeats in xy, room texture layer in z
+};
+enum RoomLayer { ROOM_WOOD = 0, ROOM_BRICK, NUM_ROOM_LAYERS };
+const char* roomFiles[NUM_ROOM_LAYERS] = { "wood1.jpg", "brickwall.jpg" };
+const int roomTextureSize = 1024;
+
 struct ParticleSpawner {
 	glm::vec3 pos, dim, startVel;
 	glm::vec4 startCol, endCol;
 	int particleRate;
 	float particleLifetime;
 	float size, velRange;
+	int sprite = SPRITE_SMOKE;
 
-	float wetness = 0.0f;
+	float wetness = 0.0f; // how soaked its cell is, 1 puts it out
 };
 
-int numSpawners = 1;
 const int maxSpawners = 100;
-ParticleSpawner spawnerContainer[maxSpawners];
+
+// every spawner keeps its particles in a sub-pool of the container, the one with its own
+// index, and the water has the last. A particle reaches about this far from its centre times
+// its size (a corner of the unit quad), which is what the emitter bounds allow for.
+typedef ParticlePools<maxParticles, maxSpawners + 1> EmitterPools;
+const int numPools = maxSpawners + 1;
+const int waterPool = maxSpawners;
+const float particleRadius = 0.71f;
+
+// a look for the water and one for each spawner is as many as can be in use at once
+const int maxLooks = maxSpawners + 1;
+
+// heat and moisture over the room, about a metre per cell. Fires heat their cell, water damps
+// whatever cell it's in, and new fires start where the floor gets hot and stays dry.
+typedef VoxelField<16, 6, 16> RoomField;
+
+// Everything the simulation needs to carry on, kept in one block so a snapshot is a single copy
+struct SimulationState {
+	Particle particles[maxParticles];
+	EmitterPools pools;
+	ParticleLook looks[maxLooks];
+	int numLooks = 0;
+	ParticleSpawner spawners[maxSpawners];
+	int numSpawners = 1;
+	unsigned int nextParticleId = 0;
+	float elapsedTime = 0.0f; // Total time of simulation thus far
+	RoomField field;
+	Rng rng;
+};
+// The state and the instance staging arrays are carved from one arena, on huge pages where the
+// system gives them (the page size obtained is reported at startup)
+HugePageArena particleArena(sizeof(SimulationState) + maxParticles * (2 * sizeof(glm::vec4) + sizeof(float)) + 4 * 64);
+SimulationState& sim = *particleArena.create<SimulationState>();
+Particle (&particleContainer)[maxParticles] = sim.particles;
+EmitterPools& pools = sim.pools;
+ParticleLook (&lookPalette)[maxLooks] = sim.looks;
+int& numLooks = sim.numLooks;
+ParticleSpawner (&spawnerContainer)[maxSpawners] = sim.spawners;
+int& numSpawners = sim.numSpawners;
+unsigned int& nextParticleId = sim.nextParticleId;
+float& elapsedTime = sim.elapsedTime;
+RoomField& field = sim.field;
+Rng& rng = sim.rng;
+
+// Scenario, the setup a run starts from. The built-in default is the original scene, --scenario
+// loads one from a file (see default.scn for the format).
+enum ScenarioEventType { EVENT_WATER_ON = 0, EVENT_WATER_OFF };
+struct ScenarioEvent {
+	float time; // seconds into the simulation
+	int type;
+	glm::vec3 pos, dir; // where scripted water sprays from, and which way
+};
+const int maxScenarioEvents = 32;
+struct Scenario {
+	int capacity = maxParticles; // most particles alive at once, can't exceed maxParticles
+	uint64_t seed = 0; // 0 keeps the generator's own default
+	ParticleSpawner spawners[maxSpawners];
+	int numSpawners = 0; // burning at the start, the fire spreads into the rest
+	float spreadRate = 0.05f; // chance per second of a hot, dry floor cell catching
+	ParticleSpawner spreadSpawners[2]; // the pair placed wherever it spreads to
+	float waterRate = 1000.0f; // water particles per second while it's pouring
+	float waterLifetime = 2.0f;
+	// alpha times size under which a particle is left out of the frame, and fire that will
+	// stay under it for the rest of its life is retired. 0 draws everything.
+	float visibilityThreshold = 0.01f;
+	glm::vec3 roomMin = glm::vec3(-7.5f, -1.0f, -7.5f), roomMax = glm::vec3(7.5f, 5.0f, 7.5f); // water bounces inside
+	glm::vec3 grillPos = glm::vec3(2.0f, 0.0f, 2.0f);
+	float grillRadius = 1.0f;
+	ScenarioEvent events[maxScenarioEvents];
+	int numEvents = 0;
+};
+Scenario scenario = defaultScenario(); // read by the simulation thread, only written before it starts
+const char* scenarioPath = NULL;
+
+// snapshots
+const uint32_t SCENE_ID = 0x4D4C4550; // "PELM"
+const char* snapshotPath = "elements.snap"; // F5 saves here, F9 restores
+
+// recording, --record writes every frame out, --playback replays a file instead of simulating
+FrameRecorder recorder;
+FramePlayback playback;
+const float playbackSeekStep = 5.0f; // seconds per left/right arrow press
+
+// offline rendering, --offline <pattern> renders --frames frames at a fixed timestep into
+// an image sequence, with no visible window
+const char* offlinePattern = NULL;
+int offlineFrames = 600;
+const float offlineTimestep = 1.0f / 60.0f;
 
 glm::vec3 grav = glm::vec3(0.0f, -9.8f, 0.0f);
 
+// water moves as one fluid, the solver runs its passes on the thread pool
+FluidSolver fluid;
+
+// diffuses the room field each tick, also on the pool
+VoxelFieldSolver fieldSolver;
+const float fireHeat = 10.0f; // heat per second a dry spawner puts into its cell
+const float ignitionHeat = 1.0f; // floor cells this hot, or with air this hot above them, can catch
+const float dryEnough = 0.2f; // and only while under this fraction of saturation
+const float boilHeat = 0.5f; // water in a cell this hot boils off into moisture
+const float soakRate = 1.0f; // moisture per second a water particle leaves in a cooler cell
+
 bool spaceHeld = false;
 
-int main()
+// simulation thread, ticks at a fixed rate independent of the frame rate. Camera and keys reach
+// it only through SimInput, copied in once per tick.
+struct SimInput {
+	glm::vec3 cameraPos, cameraFront, cameraUp;
+	bool spaceHeld;
+	float emission; // from the current quality level
+	int fluidSubsteps;
+};
+SimInput simInput; // the current tick's copy, only touched by the simulation
+SimulationThread<SimInput> simThread;
+const float simTickSeconds = 1.0f / 60.0f;
+
+int main(int argc, char** argv)
 {
+	particleArena.report("Particle memory");
+
+	// command line
+	bool restoreAtStart = false;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--restore" && i + 1 < argc)
+		{ // start from a saved snapshot instead of the default setup
+			snapshotPath = argv[++i];
+			restoreAtStart = true;
+		}
+		else if (arg == "--scenario" && i + 1 < argc)
+		{ // e.g. --scenario fires_water.scn, or its compiled fires_water.scnb
+			scenarioPath = argv[++i];
+		}
+		else if (arg == "--record" && i + 1 < argc)
+		{
+			recorder.open(argv[++i], maxParticles);
+		}
+		else if (arg == "--playback" && i + 1 < argc)
+		{
+			playback.open(argv[++i]);
+		}
+		else if (arg == "--offline" && i + 1 < argc)
+		{ // e.g. --offline frames/frame_%05d.png
+			offlinePattern = argv[++i];
+		}
+		else if (arg == "--frames" && i + 1 < argc)
+		{
+			offlineFrames = atoi(argv[++i]);
+		}
+		else if (arg == "--particle-scale" && i + 1 < argc)
+		{ // 1, 2 or 4
+			particleScale = std::min(std::max(atoi(argv[++i]), 1), 4);
+		}
+		else if (arg == "--overdraw")
+		{
+			overdrawAtStart = true;
+		}
+		else if (arg == "--full-sort")
+		{ // sort from scratch every frame, to compare against
+			fullSort = true;
+		}
+		else if (arg == "--benchmark" && i + 1 < argc)
+		{
+			if (!benchmark.init(argv[++i]))
+				return -1;
+		}
+		else if (arg == "--target-fps" && i + 1 < argc)
+		{
+			targetFps = atof(argv[++i]);
+		}
+	}
+
 	// Before loop starts ---------------------
 	// glfw init
 	glfwInit();
@@ -96,78 +377,91 @@ int main()
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 	// glfw window creation
-	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "5611 HW1", NULL, NULL);
+	GLFWwindow* window;
+	if (offlinePattern)
+	{
+		window = createOffscreenWindow(SCR_WIDTH, SCR_HEIGHT, "5611 HW1");
+		if (!window)
+		{
+			glfwTerminate();
+			return -1;
+		}
+	}
+	else
+	{
+		window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "5611 HW1", NULL, NULL);
+	}
 	glfwMakeContextCurrent(window);
 
 	// register callbacks
 	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 	//Register mouse movement callback
 	glfwSetCursorPosCallback(window, mouse_callback);
+	glfwSetKeyCallback(window, key_callback);
 
 	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
 	// Initialize glad
 	gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+	loadGLExtensions((GLADloadproc)glfwGetProcAddress);
+
+	// a benchmark measures how fast frames can go, not the display's refresh rate
+	if (benchmark.enabled())
+	{
+		glfwSwapInterval(0);
+		benchmark.start();
+	}
+	// offline renders take as long as they take, at full quality
+	governor.init(targetFps > 0.0 && !offlinePattern ? 1.0 / targetFps : 0.0, numQualityLevels);
+	if (benchmark.enabled() || governor.enabled())
+		frameTimer.start();
+
+	// Textures and shaders load in the background, the first frames draw placeholders
+	ThreadPool threadPool;
+	AssetLoader assets(threadPool);
+	FluidSettings fluidSettings;
+	fluidSettings.gravity = grav;
+	fluid.init(threadPool, fluidSettings);
+	fieldSolver.init(threadPool);
+
+	// offline renders draw into an FBO and are written out on the same pool
+	FrameCapture frameCapture(threadPool);
+	if (offlinePattern && !frameCapture.init(SCR_WIDTH, SCR_HEIGHT, offlinePattern))
+	{
+		glfwTerminate();
+		return -1;
+	}
+
+	// view and projection are shared by every program through one uniform buffer
+	const unsigned int CAMERA_BINDING = 0;
+	Shader::shareUniformBlock("Camera", CAMERA_BINDING);
+	unsigned int cameraUBO;
+	glGenBuffers(1, &cameraUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, cameraUBO);
+	glBufferData(GL_UNIFORM_BUFFER, 2 * sizeof(glm::mat4), NULL, GL_STREAM_DRAW); // will add data in update
+	glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BINDING, cameraUBO);
 
 	//glEnable(GL_CULL_FACE);
 	glEnable(GL_DEPTH_TEST);
 
 	// Setup ----------------------------------
 
-	// Spawners
-	// one fire on grill
-	spawnerContainer[0].pos = glm::vec3(2.0, 0.5f, 2.0f);
-	spawnerContainer[0].dim = glm::vec3(0.5f, 0.0f, 0.5f);
-	spawnerContainer[0].startVel = glm::vec3(0.25, 1.0f, 0.0f);
-	spawnerContainer[0].velRange = 3.0f;
-	spawnerContainer[0].particleRate = 50;
-	spawnerContainer[0].particleLifetime = 3.0f;
-	spawnerContainer[0].size = 1.0f;
-	spawnerContainer[0].startCol = glm::vec4(0.682f, 0.306f, 0.0f, 0.8f);
-	spawnerContainer[0].endCol = glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
-
-	spawnerContainer[1].pos = glm::vec3(2.0, 0.5f, 2.0f);
-	spawnerContainer[1].dim = glm::vec3(0.5f, 0.0f, 0.5f);
-	spawnerContainer[1].startVel = glm::vec3(0.25, 1.0f, 0.0f);
-	spawnerContainer[1].velRange = 1.0f;
-	spawnerContainer[1].particleRate = 200;
-	spawnerContainer[1].particleLifetime = 0.5f;
-	spawnerContainer[1].size = 0.5f;
-	spawnerContainer[1].startCol = glm::vec4(1.0f, 1.0f, 0.0f, 1.0f);
-	spawnerContainer[1].endCol = glm::vec4(1.0f, 0.0f, 0.0f, 0.5f);
-	/*
-	for (int i = 2; i < numSpawners*2; i += 2)
+	// Spawners, collision and timeline all come from the scenario
+	if (scenarioPath)
+		loadScenario(scenarioPath, SCENE_ID, scenario, parseScenario);
+	applyScenario();
+
+	if (restoreAtStart)
 	{
-		float rX, rY, rZ;
-		rX = ((float)rand() / RAND_MAX) * 14.0f - 7.0f;
-		rZ = ((float)rand() / RAND_MAX) * 14.0f - 7.0f;
-		spawnerContainer[i].pos = glm::vec3(rX, -0.5f, rZ);
-		spawnerContainer[i].dim = glm::vec3(0.5f, 0.0f, 0.5f);
-		spawnerContainer[i].startVel = glm::vec3(0.25, 1.0f, 0.0f);
-		spawnerContainer[i].velRange = 3.0f;
-		spawnerContainer[i].particleRate = 50;
-		spawnerContainer[i].particleLifetime = 3.0f;
-		spawnerContainer[i].size = 1.0f;
-		spawnerContainer[i].startCol = glm::vec4(0.682f, 0.306f, 0.0f, 0.8f);
-		spawnerContainer[i].endCol = glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
-
-		spawnerContainer[i + 1].pos = glm::vec3(rX, -0.5f, rZ);
-		spawnerContainer[i + 1].dim = glm::vec3(0.5f, 0.0f, 0.5f);
-		spawnerContainer[i + 1].startVel = glm::vec3(0.25, 1.0f, 0.0f);
-		spawnerContainer[i + 1].velRange = 1.0f;
-		spawnerContainer[i + 1].particleRate = 200;
-		spawnerContainer[i + 1].particleLifetime = 0.5f;
-		spawnerContainer[i + 1].size = 0.5f;
-		spawnerContainer[i + 1].startCol = glm::vec4(1.0f, 1.0f, 0.0f, 1.0f);
-		spawnerContainer[i + 1].endCol = glm::vec4(1.0f, 0.0f, 0.0f, 0.5f);
-	}
-	//*/
+		loadSnapshot(snapshotPath, SCENE_ID, sim);
+	}
 
 	// Particles
 
 	// allocate mem for particle data
-	static glm::vec4* particlePositionData = new glm::vec4[maxParticles];
-	static glm::vec4* particleColorData = new glm::vec4[maxParticles];
+	static glm::vec4* particlePositionData = particleArena.createArray<glm::vec4>(maxParticles);
+	static glm::vec4* particleColorData = particleArena.createArray<glm::vec4>(maxParticles);
+	static float* particleSpriteData = particleArena.createArray<float>(maxParticles);
 
 	// VBO for particle position and size
 	unsigned int particle_position_buffer;
@@ -179,24 +473,17 @@ int main()
 	glGenBuffers(1, &particle_color_buffer);
 	glBindBuffer(GL_ARRAY_BUFFER, particle_color_buffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4) * maxParticles, NULL, GL_STREAM_DRAW); // will add data in update
-
-	float particle_vertices[] = {
-		-0.5f, -0.5f, 0.0f,
-		 0.5f, -0.5f, 0.0f,
-		-0.5f,  0.5f, 0.0f,
-		 0.5f,  0.5f, 0.0f
-	};
-	// 1st create and bind VAO
+	// VBO for particle sprite layer
+	unsigned int particle_sprite_buffer;
+	glGenBuffers(1, &particle_sprite_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, particle_sprite_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * maxParticles, NULL, GL_STREAM_DRAW); // will add data in update
+
+	// 1st create and bind VAO. There is no vertex data, each corner comes from the outline
+	// of the instance's sprite (see spriteoutline.h)
 	unsigned int particle_VAO;
 	glGenVertexArrays(1, &particle_VAO);
 	glBindVertexArray(particle_VAO);
-	// VBO for particle vertex data
-	unsigned int particle_vertex_buffer;
-	glGenBuffers(1, &particle_vertex_buffer);
-	glBindBuffer(GL_ARRAY_BUFFER, particle_vertex_buffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(particle_vertices), particle_vertices, GL_STATIC_DRAW);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0); // pos
-	glEnableVertexAttribArray(0);
 
 	// VBO for particle position and size
 	glEnableVertexAttribArray(1);
@@ -210,500 +497,246 @@ int main()
 	glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glVertexAttribDivisor(2, 1);
+	// VBO for particle sprite layer
+	glEnableVertexAttribArray(3);
+	glBindBuffer(GL_ARRAY_BUFFER, particle_sprite_buffer);
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glVertexAttribDivisor(3, 1);
 
 	// particle shader
-	Shader particleShader("particle.vert", "particle.frag");
-
-	// particle texture
-	unsigned int textures[5];
-	glGenTextures(4, textures);
-	glBindTexture(GL_TEXTURE_2D, textures[0]);
-	int width, height, nrChannels;
-	stbi_set_flip_vertically_on_load(true);
-	unsigned char *data = stbi_load("smoke1.png", &width, &height, &nrChannels, 0);
-	if (data)
-	{
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
-	}
-	else
-	{
-		std::cout << "Failed to load texture" << std::endl;
-	}
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	stbi_image_free(data);
-	particleShader.use();
-	//glUniform1i(glGetUniformLocation(particleShader.ID, "texture1"), 0);
-	particleShader.setInt("texture1", 0);
-
-	// Floor
-	float floor_vertices[] = {
-		-15.0f, -1.0f, -15.0f, -3.0f, -3.0f,
-		15.0f, -1.0f, -15.0f, 3.0f, -3.0f,
-		-15.0f, -1.0f, 15.0f, -3.0f, 3.0f,
-		15.0f, -1.0f, 15.0f, 3.0f, 3.0f,
+	Shader particleShader;
+	assets.shader(particleShader, "particle.vert", "particle.frag");
+	Shader::Uniform particleSprites = particleShader.uniform("sprites");
+	Shader::Uniform particleOutline = particleShader.uniform("outline");
+	// same particles with every fragment counted, for the overdraw view
+	Shader overdrawShader;
+	assets.shader(overdrawShader, "particle.vert", "overdraw.frag");
+	Shader::Uniform overdrawOutline = overdrawShader.uniform("outline");
+
+	// particle sprites, textures[0] is a 2D array texture. Each sprite is drawn as a polygon
+	// trimmed to its visible texels rather than as a full quad.
+	unsigned int textures[2];
+	glGenTextures(2, textures);
+	std::vector<glm::vec2> spriteOutlines;
+	assets.textureArray(textures[0], std::vector<std::string>(spriteFiles, spriteFiles + NUM_SPRITES), spriteSize, GL_CLAMP_TO_EDGE, glm::vec4(1.0f, 1.0f, 1.0f, 0.25f), &spriteOutlines);
+
+	// Room
+	// every surface is the same unit quad placed by its per-instance model matrix
+	float quad_vertices[] = {
+		-0.5f, -0.5f, 0.0f,
+		 0.5f, -0.5f, 0.0f,
+		-0.5f,  0.5f, 0.0f,
+		 0.5f,  0.5f, 0.0f
 	};
+	std::vector<SurfaceInstance> roomSurfaces;
+	glm::vec3 xAxis = glm::vec3(30.0f, 0.0f, 0.0f);
+	// floor and ceiling
+	roomSurfaces.push_back(makeSurface(glm::mat4(0.5f), glm::vec3(0.0f, -1.0f, 0.0f), xAxis, glm::vec3(0.0f, 0.0f, 30.0f), glm::vec2(6.0f, 6.0f), ROOM_WOOD));
+	glm::mat4 surfaceModel = glm::mat4(0.5f);
+	surfaceModel = glm::translate(surfaceModel, glm::vec3(0.0f, 5.5f, 0.0f));
+	roomSurfaces.push_back(makeSurface(surfaceModel, glm::vec3(0.0f, -1.0f, 0.0f), xAxis, glm::vec3(0.0f, 0.0f, 30.0f), glm::vec2(6.0f, 6.0f), ROOM_BRICK));
+	// walls
+	glm::vec3 wallCenter = glm::vec3(0.0f, 4.5f, 0.0f), wallUp = glm::vec3(0.0f, 11.0f, 0.0f);
+	glm::vec2 wallRepeat = glm::vec2(6.0f, 4.0f);
+	surfaceModel = glm::mat4(0.5f);
+	surfaceModel = glm::translate(surfaceModel, glm::vec3(0.0f, 0.0f, -7.5f));
+	roomSurfaces.push_back(makeSurface(surfaceModel, wallCenter, xAxis, wallUp, wallRepeat, ROOM_BRICK));
+	surfaceModel = glm::mat4(0.5f);
+	surfaceModel = glm::translate(surfaceModel, glm::vec3(0.0f, 0.0f, 7.5f));
+	roomSurfaces.push_back(makeSurface(surfaceModel, wallCenter, xAxis, wallUp, wallRepeat, ROOM_BRICK));
+	surfaceModel = glm::mat4(0.5f);
+	surfaceModel = glm::rotate(surfaceModel, glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	surfaceModel = glm::translate(surfaceModel, glm::vec3(0.0f, 0.0f, 7.5f));
+	roomSurfaces.push_back(makeSurface(surfaceModel, wallCenter, xAxis, wallUp, wallRepeat, ROOM_BRICK));
+	surfaceModel = glm::mat4(0.5f);
+	surfaceModel = glm::rotate(surfaceModel, glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	surfaceModel = glm::translate(surfaceModel, glm::vec3(0.0f, 0.0f, -7.5f));
+	roomSurfaces.push_back(makeSurface(surfaceModel, wallCenter, xAxis, wallUp, wallRepeat, ROOM_BRICK));
+	const int numRoomSurfaces = (int)roomSurfaces.size();
+
 	// 1st create and bind VAO
-	unsigned int floor_VAO;
-	glGenVertexArrays(1, &floor_VAO);
-	glBindVertexArray(floor_VAO);
-	// VBO for particle vertex data
-	unsigned int floor_VBO;
-	glGenBuffers(1, &floor_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, floor_VBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(floor_vertices), floor_vertices, GL_STATIC_DRAW);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 5, (void*)0); // pos
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 5, (void*)(3 * sizeof(float))); // uv
+	unsigned int room_VAO;
+	glGenVertexArrays(1, &room_VAO);
+	glBindVertexArray(room_VAO);
+	// VBO for quad vertex data
+	unsigned int room_vertex_buffer;
+	glGenBuffers(1, &room_vertex_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, room_vertex_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad_vertices), quad_vertices, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0); // pos
 	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	// shader
-	Shader texturedShader("textured.vert", "textured.frag");
-	// texture
-	glBindTexture(GL_TEXTURE_2D, textures[1]);
-	data = stbi_load("wood1.jpg", &width, &height, &nrChannels, 0);
-	if (data)
-	{
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
+	// VBO for surface instances, never changes after this
+	unsigned int room_instance_buffer;
+	glGenBuffers(1, &room_instance_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, room_instance_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(SurfaceInstance) * numRoomSurfaces, roomSurfaces.data(), GL_STATIC_DRAW);
+	for (int i = 0; i < 4; i++)
+	{ // model matrix, one column per attribute
+		glEnableVertexAttribArray(1 + i);
+		glVertexAttribPointer(1 + i, 4, GL_FLOAT, GL_FALSE, sizeof(SurfaceInstance), (void*)(offsetof(SurfaceInstance, model) + sizeof(glm::vec4) * i));
+		glVertexAttribDivisor(1 + i, 1);
 	}
-	else
-	{
-		std::cout << "Failed to load texture" << std::endl;
-	}
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	stbi_image_free(data);
-
-	// Wall
-	float wall_vertices[] = {
-		-15.0f, -1.0f, 0.0f, -3.0f, -2.0f,
-		15.0f, -1.0f, 0.0f, 3.0f, -2.0f,
-		-15.0f, 10.0f, 0.0f, -3.0f, 2.0f,
-		15.0f, 10.0f, 0.0f, 3.0f, 2.0f,
-	};
-	// 1st create and bind VAO
-	unsigned int wall_VAO;
-	glGenVertexArrays(1, &wall_VAO);
-	glBindVertexArray(wall_VAO);
-	// VBO for particle vertex data
-	unsigned int wall_VBO;
-	glGenBuffers(1, &wall_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, wall_VBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(wall_vertices), wall_vertices, GL_STATIC_DRAW);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 5, (void*)0); // pos
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 5, (void*)(3 * sizeof(float))); // uv
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	// texture
-	glBindTexture(GL_TEXTURE_2D, textures[2]);
-	data = stbi_load("brickwall.jpg", &width, &height, &nrChannels, 0);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	stbi_image_free(data);
+	glEnableVertexAttribArray(5);
+	glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(SurfaceInstance), (void*)offsetof(SurfaceInstance, uvLayer));
+	glVertexAttribDivisor(5, 1);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	// shader
+	Shader texturedShader;
+	assets.shader(texturedShader, "textured.vert", "textured.frag");
+	Shader::Uniform texturedTextures = texturedShader.uniform("textures");
+	// textures, textures[1] is a 2D array texture with one layer per surface material
+	assets.textureArray(textures[1], std::vector<std::string>(roomFiles, roomFiles + NUM_ROOM_LAYERS), roomTextureSize, GL_REPEAT, glm::vec4(0.55f, 0.45f, 0.4f, 1.0f));
 
 	// grill
-	const int xSegments = 25;
-	const int ySegments = 50;
-	float sphereVertices[xSegments * ySegments * 3];
-
-	float PI = 3.14159265f;
-	for (unsigned int y = 0; y < ySegments; y++)
-	{
-		for (unsigned int x = 0; x < xSegments; x++)
+	// bowl levels of detail come precomputed from mesh.h, picked each frame by on-screen size
+	LodMesh grillMesh;
+	grillMesh.addLevel(bowlLod0, 200.0f);
+	grillMesh.addLevel(bowlLod1, 60.0f);
+	grillMesh.addLevel(bowlLod2, 20.0f);
+	grillMesh.addLevel(bowlLod3, 0.0f);
+	grillMesh.upload();
+	glm::vec3 grillPos = scenario.grillPos;
+	float grillRadius = scenario.grillRadius;
+	// shader
+	Shader grillShader;
+	assets.shader(grillShader, "baseShader.vert", "baseShader.frag");
+	Shader::Uniform grillModel = grillShader.uniform("model");
+
+	// programs for the reduced resolution particle pass, its targets are made on first use
+	offscreenParticles.init(assets, particleScale, nearPlane, farPlane);
+	overdraw.init(assets, overdrawAtStart);
+	depthSorter.init(maxParticles, !fullSort);
+
+	if (offlinePattern)
+	{ // batch renders must be repeatable, so don't start until nothing is a placeholder
+		while (!assets.shadersReady() || !assets.texturesReady())
 		{
-			float xSegment = (float)x / (float)xSegments;
-			float ySegment;
-			if (y == 0)
-			{
-				ySegment = -0.5f;
-			}
-			else
-			{
-				ySegment = (float)y / (float)ySegments + 0.5f;
-			}
-
-			int index = (y*xSegments + x) * 3;
-			sphereVertices[index] = std::cos(xSegment * PI*2.0f) * std::sin(ySegment * PI); // x pos
-			sphereVertices[index + 1] = std::cos(ySegment * PI); // y pos
-			sphereVertices[index + 2] = std::sin(xSegment * PI*2.0f) * std::sin(ySegment * PI); // z pos
+			assets.update();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
 		}
 	}
-	int sphereIndices[(xSegments) * (ySegments) * 6]; // Make sure this is sized correctly
-	for (unsigned int y = 0; y < (ySegments); y++) // Dont go below last row
-	{
-		for (unsigned int x = 0; x < (xSegments); x++) // Dont go after last column
-		{
-			int index = (y*xSegments + x) * 6;
-			sphereIndices[index] = ((y)*xSegments) + x;				// 0
-			sphereIndices[index + 1] = ((y + 1)*xSegments) + x;		// |
-			sphereIndices[index + 2] = ((y + 1)*xSegments) + x + 1;	// 0--0
-
-			sphereIndices[index + 3] = ((y)*xSegments) + x;			// 0--0
-			sphereIndices[index + 4] = ((y)*xSegments) + x + 1;		//  \ |
-			sphereIndices[index + 5] = ((y + 1)*xSegments) + x + 1;	//    0
-		}
-	}
-	// Buffer stuff for sphere
-	unsigned int sphereVAO, sphereVBO, sphereEBO;
-	glGenVertexArrays(1, &sphereVAO);
-	glBindVertexArray(sphereVAO);
-	glGenBuffers(1, &sphereVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, sphereVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(sphereVertices), sphereVertices, GL_STATIC_DRAW);
-	glGenBuffers(1, &sphereEBO);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphereEBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(sphereIndices), sphereIndices, GL_STATIC_DRAW);
-	// Tell OpenGL how to use vertex data
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0); //Uses whatever VBO is bound to GL_ARRAY_BUFFER
-	glEnableVertexAttribArray(0);
-	// shader
-	Shader grillShader("baseShader.vert", "baseShader.frag");
+
+	// simulation runs on its own thread unless replaying or rendering offline
+	static std::vector<int> slotLookup(maxParticles, -1);
+	static std::vector<int> visibleSlot;
+	static std::vector<unsigned int> visibleId;
+	ParticleFrame offlineFrame;
+	if (!playback.isOpen() && !offlinePattern)
+		simThread.start(simTickSeconds, stepSimulation);
 
 	// render loop ----------------------------
 	while (!glfwWindowShouldClose(window))
 	{
+		frameTimer.beginFrame();
+		const QualityLevel& quality = qualityLevels[governor.level()];
+
 		// Set deltaT
-		float currentFrame = glfwGetTime();
+		float currentFrame = offlinePattern ? lastFrame + offlineTimestep : (float)glfwGetTime();
 		deltaTime = currentFrame - lastFrame;
 		lastFrame = currentFrame;
 
 		// input
 		processInput(window);
 
-		// processing
-		
-		// Spawn new spawners (spread the fire)
-		if (numSpawners < maxSpawners)
-		{
-			if (((float)rand() / RAND_MAX) < 0.5f * deltaTime)
-			{
-				int i = numSpawners;
-				ParticleSpawner &s = spawnerContainer[rand() % numSpawners]; //Spawner to split from
+		// what is actually being drawn into, which follows the window once it's resized
+		int frameWidth = SCR_WIDTH, frameHeight = SCR_HEIGHT;
+		if (!offlinePattern)
+			glfwGetFramebufferSize(window, &frameWidth, &frameHeight);
 
-				if (s.wetness < 1.0f)
-				{
-					float rX, rY, rZ;
-					rX = ((float)rand() / RAND_MAX) * 6.0f - 3.0f;
-					rZ = ((float)rand() / RAND_MAX) * 6.0f - 3.0f;
-					if ((s.pos[0] + rX) > -7.5f && (s.pos[0] + rX) < 7.5f && (s.pos[2] + rZ) > -7.5f && (s.pos[2] + rZ) < 7.5f)
-					{
-						spawnerContainer[i].pos = glm::vec3(s.pos[0] + rX, -0.5f, s.pos[2] + rZ);
-						spawnerContainer[i].dim = glm::vec3(0.5f, 0.0f, 0.5f);
-						spawnerContainer[i].startVel = glm::vec3(0.25, 1.0f, 0.0f);
-						spawnerContainer[i].velRange = 3.0f;
-						spawnerContainer[i].particleRate = 50;
-						spawnerContainer[i].particleLifetime = 3.0f;
-						spawnerContainer[i].size = 1.0f;
-						spawnerContainer[i].startCol = glm::vec4(0.682f, 0.306f, 0.0f, 0.8f);
-						spawnerContainer[i].endCol = glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
-						spawnerContainer[i].wetness = 0.0f;
-
-						spawnerContainer[i + 1].pos = glm::vec3(s.pos[0] + rX, -0.5f, s.pos[2] + rZ);
-						spawnerContainer[i + 1].dim = glm::vec3(0.5f, 0.0f, 0.5f);
-						spawnerContainer[i + 1].startVel = glm::vec3(0.25, 1.0f, 0.0f);
-						spawnerContainer[i + 1].velRange = 1.0f;
-						spawnerContainer[i + 1].particleRate = 200;
-						spawnerContainer[i + 1].particleLifetime = 0.5f;
-						spawnerContainer[i + 1].size = 0.5f;
-						spawnerContainer[i + 1].startCol = glm::vec4(1.0f, 1.0f, 0.0f, 1.0f);
-						spawnerContainer[i + 1].endCol = glm::vec4(1.0f, 0.0f, 0.0f, 0.5f);
-						spawnerContainer[i + 1].wetness = 0.0f;
-
-						numSpawners += 2;
-					}
-				}
-			}
-		}
+		// set up transformation matrices, the particles are culled against them before drawing
+		glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
+		float aspect = frameWidth > 0 && frameHeight > 0 ? (float)frameWidth / (float)frameHeight : (float)SCR_WIDTH / (float)SCR_HEIGHT;
+		glm::mat4 projection = glm::perspective(glm::radians(45.0f), aspect, nearPlane, farPlane);
 
-		// Spawn particles
-		// Water
-		if (spaceHeld) {
-			int toSpawn = (int)(deltaTime*1000.0f);
-			for (int i = 0; i < toSpawn; i++)
-			{
-				int index = findUnusedParticle();
-				if (index >= 0)
-				{
-					Particle& p = particleContainer[index];
-
-					p.life = 2.0f;
-					p.type = 1;
-					float rX = ((float)rand() / RAND_MAX) * 1.0f - 0.5f;
-					float rY = ((float)rand() / RAND_MAX) * 1.0f - 0.5f;
-					float rZ = ((float)rand() / RAND_MAX) * 1.0f - 0.5f;
-					p.pos = cameraPos + glm::vec3(rX,rY,rZ) + cameraUp;
-					p.vel = cameraFront * 10.0f;
-					p.maxLife = p.life;
-
-					float rR = ((float)rand() / RAND_MAX) * 0.1f - 0.05f;
-					float rG = ((float)rand() / RAND_MAX) * 0.1f - 0.05f;
-					float rB = ((float)rand() / RAND_MAX) * 0.1f - 0.05f;
-					float rA = ((float)rand() / RAND_MAX) * 0.1f - 0.05f;
-					p.col = glm::vec4(0.0, 0.2, 0.9, 0.8f) + glm::vec4(rR,rG,rB,rA);
-					p.startCol = p.col;
-					p.endCol = glm::vec4(0.7, 0.9, 1.0, 0.1f);
-					p.size = 0.5f;
-				}
-			}
+		// finish any textures/shaders that are ready
+		assets.update();
+
+		// processing
+		
+		int numParticles; // number of particles actually existing right now
+		if (playback.isOpen())
+		{ // replay recorded frames instead of simulating
+			numParticles = playback.advance(deltaTime, maxParticles, particlePositionData, particleColorData, particleSpriteData);
+			sortInstances(numParticles, NULL, NULL, particlePositionData, particleColorData, particleSpriteData);
 		}
-		// Fire
-		for (int i = 0; i < numSpawners; i++)
+		else
 		{
-			ParticleSpawner &s = spawnerContainer[i];
-
-			int toSpawn = (int)(deltaTime*s.particleRate*(1.0f - s.wetness));
-
-			float r = ((float)rand() / RAND_MAX);
-			if (r < (deltaTime*s.particleRate*(1.0f - s.wetness) - (float)toSpawn))
-			{ // use non-integers to determine chance of spawning particle
-				toSpawn++;
+			SimInput input = { cameraPos, cameraFront, cameraUp, spaceHeld, quality.emission, quality.fluidSubsteps };
+			numParticles = 0;
+			const ParticleFrame* drawn = NULL; // the frame the instances came from
+			if (offlinePattern)
+			{ // step in lockstep with the frames so renders repeat exactly
+				offlineFrame.time += offlineTimestep;
+				stepSimulation(offlineTimestep, input, offlineFrame);
+				numParticles = interpolateFrames(NULL, offlineFrame, 1.0f, slotLookup, particlePositionData, particleColorData, particleSpriteData);
+				drawn = &offlineFrame;
 			}
-
-			for (int i = 0; i < toSpawn; i++)
+			else
 			{
-				int index = findUnusedParticle();
-				if (index >= 0)
+				simThread.setInput(input);
+				const ParticleFrame* previous;
+				const ParticleFrame* current;
+				float alpha;
+				if (simThread.acquire(previous, current, alpha))
 				{
-					Particle& p = particleContainer[index];
-
-					p.life = s.particleLifetime;
-					p.type = 0;
-					float offX = s.dim[0] * ((float)rand() / RAND_MAX);
-					float posX = s.pos[0] - (s.dim[0] / 2.0f) + offX;
-					float offY = s.dim[1] * ((float)rand() / RAND_MAX);
-					float posY = s.pos[1] - (s.dim[1] / 2.0f) + offY;
-					float offZ = s.dim[2] * ((float)rand() / RAND_MAX);
-					float posZ = s.pos[2] - (s.dim[2] / 2.0f) + offZ;
-					p.pos = glm::vec3(posX, posY, posZ);
-
-					float rTheta = ((float)rand() / RAND_MAX) * 360.0f;
-					float rPhi = ((float)rand() / RAND_MAX) * 10.0f;
-					float rMag = ((float)rand() / RAND_MAX) * 2.0f;
-
-					glm::mat4 rot = glm::mat4(1.0f);
-					rot = glm::rotate(rot, glm::radians(rPhi), glm::vec3(0.0f, 0.0f, 1.0f));
-					rot = glm::rotate(rot, glm::radians(rTheta), glm::vec3(0.0f, 1.0f, 0.0f));
-					p.vel = glm::vec3(rot * glm::vec4(rMag * s.startVel, 1.0f));
-
-					p.maxLife = s.particleLifetime;
-
-					p.col = s.startCol;
-					p.startCol = s.startCol;
-					p.endCol = s.endCol;
-
-					//p.size = (s.maxSize - s.minSize) * ((float)rand() / RAND_MAX);
-					p.size = s.size;
+					numParticles = interpolateFrames(previous, *current, alpha, slotLookup, particlePositionData, particleColorData, particleSpriteData);
+					drawn = current;
 				}
 			}
-		}
-
-		// simulate particles on cpu
-		int numParticles = 0; // number of particles actually existing right now
-		for (int i = 0; i < maxParticles; i++)
-		{
-			Particle& p = particleContainer[i];
-			if (p.life > 0.0f)
-			{ // For each currently alive particle
-				p.life -= deltaTime;
-				if (p.life > 0.0f)
-				{ // If the particle didn't die this frame
-					if (p.type == 1)
-					{
-						p.vel += grav * deltaTime;
-					}
-					p.pos += deltaTime * p.vel;
-
-					float t = (p.life / p.maxLife);
-					p.col = t * p.startCol + (1 - t) * p.endCol;
-
-					p.cameraDist = glm::dot(p.pos, cameraFront);
-					
-					if (p.type == 1) //Only for water
-					{
-						bool coll = false;
-						// Wall collisions
-						if (p.pos[1] < -1.0f)
-						{
-							p.pos[1] = -1.0;
-							p.vel[1] = -p.vel[1] * 0.5;
-							coll = true;
-						}
-						else if (p.pos[1] > 5.0f)
-						{
-							p.pos[1] = 5.0;
-							p.vel[1] = -p.vel[1] * 0.5;
-							coll = true;
-						}
-						if (p.pos[0] < -7.5f)
-						{
-							p.pos[0] = -7.5;
-							p.vel[0] = -p.vel[0] * 0.5;
-							coll = true;
-						}
-						else if (p.pos[0] > 7.5f)
-						{
-							p.pos[0] = 7.5;
-							p.vel[0] = -p.vel[0] * 0.5;
-							coll = true;
-						}
-						if (p.pos[2] < -7.5f)
-						{
-							p.pos[2] = -7.5;
-							p.vel[2] = -p.vel[2] * 0.5;
-							coll = true;
-						}
-						else if (p.pos[2] > 7.5f)
-						{
-							p.pos[2] = 7.5;
-							p.vel[2] = -p.vel[2] * 0.5;
-							coll = true;
-						}
-						// Grill collision
-						if (p.pos[1] < 0.0f)
-						{
-							glm::vec3 grillOff = p.pos - glm::vec3(2.0f, 0.0f, 2.0f);
-							if (glm::length(grillOff) < 1.0f)
-							{
-								// Collision with grill detected, decide if we should bounce off top or side
-								if (p.pos[1] > -0.05)
-								{// top
-									p.pos[1] = 0.0;
-									p.vel[1] = -p.vel[1] * 0.5f;
-									coll = true;
-								}
-								else
-								{// side
-									p.pos = glm::vec3(2.0f, 0.0f, 2.0f) + glm::normalize(grillOff);
-									p.vel = glm::reflect(p.vel, glm::normalize(grillOff)) * 0.5f;
-									coll = true;
-								}
-							}
-						}
-
-						if (coll)
-						{
-							// If there was a collision randomize velocity a bit
-							float rX = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
-							float rY = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
-							float rZ = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
-							p.vel += glm::vec3(rX, rY, rZ);
-							p.cameraDist = glm::dot(p.pos, cameraFront);
-						}
-
-						// Check if you hit a fire spawner
-						for (int j = 0; j < numSpawners; j ++)
-						{
-							if (glm::length(p.pos - spawnerContainer[j].pos) < 1.0f)
-							{
-								if (spawnerContainer[j].wetness < 1.0f)
-								{
-									// Kill this particle, add wetness to spawner
-									p.life = -1.0f;
-									p.cameraDist = -INFINITY;
-									spawnerContainer[j].wetness += 0.001f;
-									//spawnerContainer[j + 1].wetness += 0.001f;
-								}
-							}
-						}
-					}
-
-				}
-				else
-				{
-					// This particle just died
-					p.cameraDist = -INFINITY;
-				}
-				numParticles++;
-			}
-		}
-		std::cout << numParticles << std::endl;
-		// Sort particles by distance to camera
-		sortParticles();
-
-		// put particle info into arrays for gpu
-		for (int i = 0; i < numParticles; i++)
-		{
-			Particle& p = particleContainer[i];
-			if (p.life > 0.0f)
-			{ // For each currently alive particle
-				particlePositionData[i] = glm::vec4(p.pos, p.size);
-				particleColorData[i] = p.col;
+			if (drawn)
+			{ // Drop the emitters out of view, then sort what's left by distance to camera
+				numParticles = cullEmitters(*drawn, projection * view, visibleSlot, visibleId, particlePositionData, particleColorData, particleSpriteData);
+				sortInstances(numParticles, visibleSlot.data(), visibleId.data(), particlePositionData, particleColorData, particleSpriteData);
 			}
 		}
 
 		// rendering commands here
+		if (offlinePattern)
+			frameCapture.bind();
 		glClearColor(0.592f, 0.808f, 0.922f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+		if (!assets.shadersReady())
+		{ // Nothing can be drawn until the programs link, show just the sky until then
+			frameTimer.discardFrame();
+			glfwPollEvents();
+			glfwSwapBuffers(window);
+			continue;
+		}
+
+		// with reduced resolution particles the scene is drawn into a target of its own first
+		bool reducedParticles = offscreenParticles.beginScene(frameWidth, frameHeight);
+
 		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, textures[0]);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textures[0]);
 		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, textures[1]);
-		glActiveTexture(GL_TEXTURE2);
-		glBindTexture(GL_TEXTURE_2D, textures[2]);
-		glActiveTexture(GL_TEXTURE3);
-		glBindTexture(GL_TEXTURE_2D, textures[3]);
-		glActiveTexture(GL_TEXTURE4);
-		glBindTexture(GL_TEXTURE_2D, textures[4]);
-
-		// set up transformation matrices
-		glm::mat4 view;
-		view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
-		glm::mat4 projection = glm::mat4(1.0f);
-		projection = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textures[1]);
+
+		glBindBuffer(GL_UNIFORM_BUFFER, cameraUBO);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), glm::value_ptr(view));
+		glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(projection));
 		
-		// room 
-		// floor
-		glBindVertexArray(floor_VAO);
+		// room, every surface in one draw
+		glBindVertexArray(room_VAO);
 		texturedShader.use();
-		texturedShader.setInt("texture1", 1);
-		texturedShader.setMat4("view", view);
-		texturedShader.setMat4("projection", projection);
-		texturedShader.setMat4("model", glm::mat4(0.5f));
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-		// ceiling
-		texturedShader.setInt("texture1", 2);
-		glm::mat4 model = glm::mat4(0.5f);
-		model = glm::translate(model, glm::vec3(0.0f, 5.5f, 0.0f));
-		texturedShader.setMat4("model", model);
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-		// walls
-		glBindVertexArray(wall_VAO);
-		model = glm::mat4(0.5f);
-		model = glm::translate(model, glm::vec3(0.0f, 0.0f, -7.5f));
-		texturedShader.setMat4("model", model);
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-		model = glm::mat4(0.5f);
-		model = glm::translate(model, glm::vec3(0.0f, 0.0f, 7.5f));
-		texturedShader.setMat4("model", model);
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-		model = glm::mat4(0.5f);
-		model = glm::rotate(model, glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-		model = glm::translate(model, glm::vec3(0.0f, 0.0f, 7.5f));
-		texturedShader.setMat4("model", model);
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-		model = glm::mat4(0.5f);
-		model = glm::rotate(model, glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-		model = glm::translate(model, glm::vec3(0.0f, 0.0f, -7.5f));
-		texturedShader.setMat4("model", model);
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		texturedShader.setInt(texturedTextures, 1);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, numRoomSurfaces);
 		// grill
 		grillShader.use();
-		grillShader.setMat4("view", view);
-		grillShader.setMat4("projection", projection);
-		model = glm::mat4(1.0f);
-		model = glm::translate(model, glm::vec3(2.0f, 0.0f, 2.0f));
-		model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f));
-		grillShader.setMat4("model", model);
-		glBindVertexArray(sphereVAO);
-		glDrawElements(GL_TRIANGLES, (xSegments) * (ySegments) * 6, GL_UNSIGNED_INT, 0);
+		glm::mat4 model = glm::mat4(1.0f);
+		model = glm::translate(model, grillPos);
+		model = glm::scale(model, glm::vec3(grillRadius, grillRadius, grillRadius));
+		grillShader.setMat4(grillModel, model);
+		float grillScreenRadius = projectedRadius(grillPos, grillRadius, cameraPos, projection, (float)frameHeight);
+		grillMesh.draw(grillMesh.selectLevel(grillScreenRadius * quality.lodScale));
 
 
 		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		if (reducedParticles)
+			offscreenParticles.beginParticles();
+		else
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 		// particles
 		glBindVertexArray(particle_VAO);
@@ -717,12 +750,42 @@ int main()
 		glBufferData(GL_ARRAY_BUFFER, maxParticles * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW); // Buffer orphaning
 		glBufferSubData(GL_ARRAY_BUFFER, 0, numParticles * sizeof(GLfloat) * 4, particleColorData);
 
+		glBindBuffer(GL_ARRAY_BUFFER, particle_sprite_buffer);
+		glBufferData(GL_ARRAY_BUFFER, maxParticles * sizeof(GLfloat), NULL, GL_STREAM_DRAW); // Buffer orphaning
+		glBufferSubData(GL_ARRAY_BUFFER, 0, numParticles * sizeof(GLfloat), particleSpriteData);
+
+		// one draw for every effect, each instance picks its own sprite layer
 		particleShader.use();
-		particleShader.setInt("texture1", 0);
-		particleShader.setMat4("view", view);
-		particleShader.setMat4("projection", projection);
-		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, numParticles);
+		particleShader.setInt(particleSprites, 0);
+		particleShader.setVec2Array(particleOutline, spriteOutlines.data(), (int)spriteOutlines.size());
+		bool measureOverdraw = overdraw.begin();
+		glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, OUTLINE_VERTICES, numParticles);
+		if (measureOverdraw)
+		{ // the same draw again into the layer counter
+			overdraw.beginCount();
+			overdrawShader.use();
+			overdrawShader.setVec2Array(overdrawOutline, spriteOutlines.data(), (int)spriteOutlines.size());
+			glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, OUTLINE_VERTICES, numParticles);
+			overdraw.endCount();
+		}
+		if (reducedParticles)
+			offscreenParticles.composite();
+		if (measureOverdraw)
+			overdraw.drawHeatMap();
 
+		if (offlinePattern)
+		{
+			frameCapture.capture();
+			if (frameCapture.framesCaptured() >= offlineFrames)
+				glfwSetWindowShouldClose(window, true);
+		}
+
+		bool measured = frameTimer.endFrame();
+		benchmark.record(frameTimer, measured);
+		if (measured && governor.update(std::max(frameTimer.cpuSeconds(), frameTimer.latestGpuSeconds()), frameTimer.intervalSeconds()))
+			applyQuality();
+		if (benchmark.finished())
+			glfwSetWindowShouldClose(window, true);
 
 		// check and call events and swap the buffers
 		glfwPollEvents();
@@ -730,6 +793,12 @@ int main()
 
 	}
 
+	simThread.stop();
+	recorder.close();
+	frameCapture.finish();
+	frameTimer.finish();
+	benchmark.record(frameTimer, false);
+	benchmark.report();
 	glfwTerminate();
 
 	return 0;
@@ -763,6 +832,46 @@ void processInput(GLFWwindow *window)
 		spaceHeld = false;
 }
 
+// Discrete key presses
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (action != GLFW_PRESS)
+		return;
+
+	if (key == GLFW_KEY_F5)
+	{
+		simThread.paused([] {
+			if (saveSnapshot(snapshotPath, SCENE_ID, sim))
+				std::cout << "Saved snapshot " << snapshotPath << std::endl;
+		});
+	}
+	else if (key == GLFW_KEY_F9)
+	{
+		simThread.paused([] {
+			if (loadSnapshot(snapshotPath, SCENE_ID, sim))
+				std::cout << "Restored snapshot " << snapshotPath << std::endl;
+		});
+	}
+	else if (key == GLFW_KEY_O)
+	{
+		overdraw.toggle();
+	}
+	else if (key == GLFW_KEY_P)
+	{ // full, half, quarter resolution particles
+		particleScale = particleScale >= 4 ? 1 : particleScale * 2;
+		offscreenParticles.setScale(std::max(particleScale, qualityLevels[governor.level()].particleScale));
+		std::cout << "Particles at 1/" << offscreenParticles.getScale() << " resolution" << std::endl;
+	}
+	else if (key == GLFW_KEY_LEFT && playback.isOpen())
+	{
+		playback.seek(playback.time() - playbackSeekStep);
+	}
+	else if (key == GLFW_KEY_RIGHT && playback.isOpen())
+	{
+		playback.seek(playback.time() + playbackSeekStep);
+	}
+}
+
 void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 {
 	if (firstMouse)
@@ -796,31 +905,691 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 	cameraFront = glm::normalize(front);
 }
 
-// Finds a particle in particleContainer which isn't used yet.
-int findUnusedParticle()
+// Finds a particle in particleContainer which isn't used yet, in the emitter's own sub-pool.
+// Returns -1 when all are taken.
+int findUnusedParticle(int pool)
 {
-	for (int i = lastUsedParticle; i < maxParticles; i++)
+	return pools.allocate(pool);
+}
+
+// One fixed tick of the simulation: spawn, move, then publish the visible particles emitter by emitter
+void stepSimulation(float dt, const SimInput& input, ParticleFrame& frame)
+{
+	simInput = input;
+	elapsedTime += dt;
+	for (PoolBounds& bounds : pools.bounds)
+		bounds.clear();
+	spawnParticles(dt);
+	fluid.setMaxSubsteps(input.fluidSubsteps);
+	simulateWater(dt);
+	int numParticles = simulateParticles(dt);
+	fieldSolver.step(field, dt);
+	if (!benchmark.enabled()) // a line per tick would be part of what's measured
+		std::cout << numParticles << std::endl;
+
+	frame.resize(numParticles, true);
+	frame.groups.clear();
+	int count = 0;
+	for (int pool = 0; pool < numPools; pool++)
+	{ // emitter by emitter, so the renderer can cull each one whole
+		ParticleGroup group = { count, 0, pools.bounds[pool].min, pools.bounds[pool].max };
+		for (int c = pools.firstChunk(pool); c >= 0; c = pools.nextChunk(c))
+		{
+			for (int i = pools.chunkBegin(c); i < pools.chunkEnd(c); i++)
+			{
+				Particle& p = particleContainer[i];
+				if (p.life <= 0.0f)
+					continue;
+				const ParticleLook& look = lookPalette[p.look];
+				glm::vec4 col = particleColor(p, look);
+				if (col.a * look.size >= scenario.visibilityThreshold)
+				{ // For each particle alive and not faded out, the rest would cost a sort, upload and blend for nothing
+					frame.slot[count] = i;
+					frame.id[count] = p.id;
+					frame.posSize[count] = glm::vec4(p.pos, look.size);
+					frame.color[count] = col;
+					frame.sprite[count] = (float)look.sprite;
+					count++;
+				}
+			}
+		}
+		group.count = count - group.first;
+		if (group.count > 0)
+			frame.groups.push_back(group);
+	}
+	frame.count = count;
+	if (recorder.isOpen())
+		recorder.addFrame((float)frame.time, count, frame.id.data(), frame.posSize.data(), frame.color.data(), frame.sprite.data());
+}
+
+// Spreads the fire and spawns this frame's water and fire particles
+void spawnParticles(float dt)
+{
+	spreadFire(dt);
+
+	// Spawn particles
+	// Water, from the camera while space is held or wherever the scenario timeline turned it on
+	glm::vec3 waterOrigin, waterDir;
+	if (waterSource(waterOrigin, waterDir)) {
+		int toSpawn = (int)(dt*scenario.waterRate);
+		if (rng.uniform() < (dt*scenario.waterRate - (float)toSpawn))
+		{ // use non-integers to determine chance of spawning particle
+			toSpawn++;
+		}
+		ParticleLook water = { glm::vec4(0.0, 0.2, 0.9, 0.8f), glm::vec4(0.7, 0.9, 1.0, 0.1f), scenario.waterLifetime, 0.5f, 1, SPRITE_DROPLET };
+		int look = toSpawn > 0 ? internLook(water) : -1;
+		for (int i = 0; i < toSpawn && look >= 0; i++)
+		{
+			int index = findUnusedParticle(waterPool);
+			if (index >= 0)
+			{
+				Particle& p = particleContainer[index];
+				p.id = nextParticleId++;
+
+				p.life = scenario.waterLifetime;
+				p.look = (uint16_t)look;
+				float rX = rng.uniform() * 1.0f - 0.5f;
+				float rY = rng.uniform() * 1.0f - 0.5f;
+				float rZ = rng.uniform() * 1.0f - 0.5f;
+				p.pos = waterOrigin + glm::vec3(rX,rY,rZ);
+				p.vel = waterDir * 10.0f;
+
+				float rR = rng.uniform() * 0.1f - 0.05f;
+				float rG = rng.uniform() * 0.1f - 0.05f;
+				float rB = rng.uniform() * 0.1f - 0.05f;
+				float rA = rng.uniform() * 0.1f - 0.05f;
+				float tint[4] = { rR, rG, rB, rA };
+				for (int c = 0; c < 4; c++)
+					p.tint[c] = (int8_t)lroundf(std::min(std::max(tint[c] / tintStep, -127.0f), 127.0f));
+			}
+		}
+	}
+	// Fire
+	for (int i = 0; i < numSpawners; i++)
 	{
-		if (particleContainer[i].life < 0)
+		ParticleSpawner &s = spawnerContainer[i];
+		int cell = field.cellAt(s.pos);
+		s.wetness = std::min(field.moisture[cell] / fieldSolver.getSettings().saturation, 1.0f);
+
+		float rate = s.particleRate*(1.0f - s.wetness)*simInput.emission;
+		int toSpawn = (int)(dt*rate);
+
+		float r = rng.uniform();
+		if (r < (dt*rate - (float)toSpawn))
+		{ // use non-integers to determine chance of spawning particle
+			toSpawn++;
+		}
+
+		ParticleLook fire = { s.startCol, s.endCol, s.particleLifetime, s.size, 0, s.sprite };
+		int look = toSpawn > 0 ? internLook(fire) : -1;
+		for (int n = 0; n < toSpawn && look >= 0; n++)
 		{
-			lastUsedParticle = i;
-			return i;
+			int index = findUnusedParticle(i);
+			if (index >= 0)
+			{
+				Particle& p = particleContainer[index];
+				p.id = nextParticleId++;
+
+				p.life = s.particleLifetime;
+				p.look = (uint16_t)look;
+				std::fill(p.tint, p.tint + 4, (int8_t)0);
+				float offX = s.dim[0] * rng.uniform();
+				float posX = s.pos[0] - (s.dim[0] / 2.0f) + offX;
+				float offY = s.dim[1] * rng.uniform();
+				float posY = s.pos[1] - (s.dim[1] / 2.0f) + offY;
+				float offZ = s.dim[2] * rng.uniform();
+				float posZ = s.pos[2] - (s.dim[2] / 2.0f) + offZ;
+				p.pos = glm::vec3(posX, posY, posZ);
+
+				float rTheta = rng.uniform() * 360.0f;
+				float rPhi = rng.uniform() * 10.0f;
+				float rMag = rng.uniform() * 2.0f;
+
+				glm::mat4 rot = glm::mat4(1.0f);
+				rot = glm::rotate(rot, glm::radians(rPhi), glm::vec3(0.0f, 0.0f, 1.0f));
+				rot = glm::rotate(rot, glm::radians(rTheta), glm::vec3(0.0f, 1.0f, 0.0f));
+				p.vel = glm::vec3(rot * glm::vec4(rMag * s.startVel, 1.0f));
+			}
 		}
+		field.heat[cell] += fireHeat * (1.0f - s.wetness) * dt;
 	}
+}
 
-	for (int i = 0; i < lastUsedParticle; i++)
+// Starts new fires on floor cells that the field has made hot enough while they're still dry,
+// at most one fire per cell
+void spreadFire(float dt)
+{
+	static bool burning[RoomField::sizeX * RoomField::sizeZ];
+	std::fill(burning, burning + RoomField::sizeX * RoomField::sizeZ, false);
+	for (int i = 0; i < numSpawners; i++)
 	{
-		if (particleContainer[i].life < 0)
+		glm::ivec3 c = field.coordAt(spawnerContainer[i].pos);
+		burning[c.z * RoomField::sizeX + c.x] = true;
+	}
+
+	float floorHeight = scenario.roomMin[1] + 0.5f;
+	int y = field.coordAt(glm::vec3(scenario.roomMin[0], floorHeight, scenario.roomMin[2])).y;
+	float dry = dryEnough * fieldSolver.getSettings().saturation;
+	for (int z = 0; z < RoomField::sizeZ; z++)
+	{
+		for (int x = 0; x < RoomField::sizeX; x++)
+		{
+			int cell = RoomField::index(x, y, z);
+			float heat = std::max(field.heat[cell], field.heat[RoomField::index(x, std::min(y + 1, RoomField::sizeY - 1), z)]);
+			if (burning[z * RoomField::sizeX + x] || heat < ignitionHeat || field.moisture[cell] > dry)
+				continue;
+			if (numSpawners + 1 >= maxSpawners || rng.uniform() >= scenario.spreadRate * dt)
+				continue;
+			// somewhere on the cell's floor, not all lined up on the grid
+			glm::vec3 pos = field.cellCenter(x, y, z);
+			pos[0] += (rng.uniform() - 0.5f) * field.cellSize[0];
+			pos[1] = floorHeight;
+			pos[2] += (rng.uniform() - 0.5f) * field.cellSize[2];
+			spawnerContainer[numSpawners] = scenario.spreadSpawners[0];
+			spawnerContainer[numSpawners].pos = pos;
+			spawnerContainer[numSpawners + 1] = scenario.spreadSpawners[1];
+			spawnerContainer[numSpawners + 1].pos = pos;
+			numSpawners += 2;
+			burning[z * RoomField::sizeX + x] = true;
+		}
+	}
+}
+
+// Moves every live particle on by dt, emitter by emitter, and grows each emitter's bounds over
+// where its particles were and now are. Returns how many are alive.
+int simulateParticles(float dt)
+{
+	int numParticles = 0; // number of particles actually existing right now
+	for (int pool = 0; pool < numPools; pool++)
+	{
+		PoolBounds& bounds = pools.bounds[pool];
+		for (int c = pools.firstChunk(pool), next; c >= 0; c = next)
+		{
+			next = pools.nextChunk(c);
+			for (int i = pools.chunkBegin(c); i < pools.chunkEnd(c); i++)
+			{
+				Particle& p = particleContainer[i];
+				if (p.life > 0.0f)
+				{ // For each currently alive particle
+					const ParticleLook& look = lookPalette[p.look];
+					bounds.grow(p.pos, particleRadius * look.size);
+					p.life -= dt;
+					if (p.life > 0.0f)
+					{ // If the particle didn't die this frame
+						if (look.type != 1)
+						{ // water is moved by the fluid solver
+							p.pos += dt * p.vel;
+						}
+						bounds.grow(p.pos, particleRadius * look.size);
+
+						// alpha only moves towards endCol from here, so once both ends are under the
+						// threshold the particle never shows again. Water is kept for the fluid.
+						float threshold = scenario.visibilityThreshold / look.size;
+						if (look.type != 1 && particleColor(p, look).a < threshold && look.endCol.a < threshold)
+							p.life = -1.0f;
+
+						if (look.type == 1) //Only for water
+						{
+							// Damp the cell it's in, over a fire it boils off all at once
+							int cell = field.cellAt(p.pos);
+							if (field.heat[cell] > boilHeat)
+							{
+								p.life = -1.0f;
+								field.moisture[cell] += 1.0f;
+							}
+							else
+							{
+								field.moisture[cell] += soakRate * dt;
+							}
+						}
+
+					}
+					if (p.life <= 0.0f)
+						pools.release(i);
+					numParticles++;
+				}
+			}
+		}
+	}
+	return numParticles;
+}
+
+// Steps the water through the fluid solver, packed into contiguous arrays for it and back
+void simulateWater(float dt)
+{
+	static std::vector<int> waterSlots;
+	static std::vector<glm::vec3> waterPos, waterVel;
+	waterSlots.clear();
+	waterPos.clear();
+	waterVel.clear();
+	for (int pool = 0; pool < numPools; pool++)
+	{ // the water pool, but a full container lends out slots in the others too
+		PoolBounds& bounds = pools.bounds[pool];
+		for (int c = pools.firstChunk(pool); c >= 0; c = pools.nextChunk(c))
 		{
-			lastUsedParticle = i;
+			for (int i = pools.chunkBegin(c); i < pools.chunkEnd(c); i++)
+			{
+				Particle& p = particleContainer[i];
+				if (p.life > 0.0f && lookPalette[p.look].type == 1)
+				{ // simulateParticles only sees where the fluid moved it to
+					bounds.grow(p.pos, particleRadius * lookPalette[p.look].size);
+					waterSlots.push_back(i);
+					waterPos.push_back(p.pos);
+					waterVel.push_back(p.vel);
+				}
+			}
+		}
+	}
+	fluid.step(dt, (int)waterSlots.size(), waterPos.data(), waterVel.data());
+	for (size_t i = 0; i < waterSlots.size(); i++)
+	{
+		Particle& p = particleContainer[waterSlots[i]];
+		p.pos = waterPos[i];
+		p.vel = waterVel[i];
+	}
+}
+
+// A particle's colour now, its look's start colour with its own tint fading into the end colour
+glm::vec4 particleColor(const Particle& p, const ParticleLook& look)
+{
+	float t = p.life / look.lifetime;
+	glm::vec4 start = look.startCol + glm::vec4(p.tint[0], p.tint[1], p.tint[2], p.tint[3]) * tintStep;
+	return t * start + (1 - t) * look.endCol;
+}
+
+// Index of look in the palette, added if it isn't there yet. -1 if the palette is full.
+int internLook(const ParticleLook& look)
+{
+	for (int i = 0; i < numLooks; i++)
+	{
+		const ParticleLook& l = lookPalette[i];
+		if (l.startCol == look.startCol && l.endCol == look.endCol && l.lifetime == look.lifetime
+			&& l.size == look.size && l.type == look.type && l.sprite == look.sprite)
 			return i;
+	}
+	if (numLooks >= maxLooks)
+		return -1;
+	lookPalette[numLooks] = look;
+	return numLooks++;
+}
+
+// Where water comes from this tick: the camera while space is held, otherwise the latest
+// water event on the scenario timeline if it turned water on
+bool waterSource(glm::vec3& origin, glm::vec3& dir)
+{
+	if (simInput.spaceHeld)
+	{
+		origin = simInput.cameraPos + simInput.cameraUp;
+		dir = simInput.cameraFront;
+		return true;
+	}
+	const ScenarioEvent* latest = NULL;
+	for (int i = 0; i < scenario.numEvents; i++)
+	{
+		const ScenarioEvent& e = scenario.events[i];
+		if (e.time <= elapsedTime && (!latest || e.time >= latest->time))
+			latest = &e;
+	}
+	if (!latest || latest->type != EVENT_WATER_ON)
+		return false;
+	origin = latest->pos;
+	dir = latest->dir;
+	return true;
+}
+
+// The scene as it was first written: a fire on the grill that spreads across the floor
+Scenario defaultScenario()
+{
+	Scenario s = Scenario();
+	s.capacity = 10000;
+	// one fire on grill
+	s.spawners[0].pos = glm::vec3(2.0, 0.5f, 2.0f);
+	s.spawners[0].dim = glm::vec3(0.5f, 0.0f, 0.5f);
+	s.spawners[0].startVel = glm::vec3(0.25, 1.0f, 0.0f);
+	s.spawners[0].velRange = 3.0f;
+	s.spawners[0].particleRate = 50;
+	s.spawners[0].particleLifetime = 3.0f;
+	s.spawners[0].size = 1.0f;
+	s.spawners[0].startCol = glm::vec4(0.682f, 0.306f, 0.0f, 0.8f);
+	s.spawners[0].endCol = glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
+
+	s.spawners[1].pos = glm::vec3(2.0, 0.5f, 2.0f);
+	s.spawners[1].dim = glm::vec3(0.5f, 0.0f, 0.5f);
+	s.spawners[1].startVel = glm::vec3(0.25, 1.0f, 0.0f);
+	s.spawners[1].velRange = 1.0f;
+	s.spawners[1].particleRate = 200;
+	s.spawners[1].particleLifetime = 0.5f;
+	s.spawners[1].size = 0.5f;
+	s.spawners[1].startCol = glm::vec4(1.0f, 1.0f, 0.0f, 1.0f);
+	s.spawners[1].endCol = glm::vec4(1.0f, 0.0f, 0.0f, 0.5f);
+	s.numSpawners = 1; // the flames only join in once the fire first spreads
+
+	s.spreadSpawners[0] = s.spawners[0];
+	s.spreadSpawners[1] = s.spawners[1];
+	return s;
+}
+
+// Reads a scenario file into scenario, default.scn lists every key
+bool parseScenario(const std::vector<ScenarioLine>& lines, Scenario& scenario)
+{
+	std::map<std::string, ParticleSpawner> presets;
+	ParticleSpawner* block = NULL; // preset or spawner being filled in
+	bool spawnersGiven = false; // the first spawner replaces the default ones
+	for (const ScenarioLine& line : lines)
+	{
+		const std::string& key = line.key();
+		size_t numWords = line.words.size();
+		if (block)
+		{
+			if (key == "end")
+				block = NULL;
+			else if (!parseSpawnerField(line, *block))
+				return false;
+			continue;
+		}
+
+		if (key == "scene")
+		{
+			if (numWords < 2 || line.words[1] != "elements")
+				return line.error("not a scenario for this scene");
+		}
+		else if (key == "capacity")
+		{
+			float capacity;
+			if (!line.numbers(1, &capacity, 1))
+				return false;
+			scenario.capacity = std::min(std::max((int)capacity, 1), maxParticles);
+			if ((int)capacity > maxParticles)
+				std::cout << "Scenario line " << line.lineNumber << ": capacity limited to " << maxParticles << std::endl;
+		}
+		else if (key == "seed")
+		{
+			if (numWords < 2)
+				return line.error("expected a seed");
+			scenario.seed = strtoull(line.words[1].c_str(), NULL, 10);
+		}
+		else if (key == "room")
+		{
+			float bounds[6];
+			if (!line.numbers(1, bounds, 6))
+				return false;
+			scenario.roomMin = glm::vec3(bounds[0], bounds[1], bounds[2]);
+			scenario.roomMax = glm::vec3(bounds[3], bounds[4], bounds[5]);
+		}
+		else if (key == "water")
+		{ // water <particles per second> <lifetime>
+			float water[2];
+			if (!line.numbers(1, water, 2))
+				return false;
+			scenario.waterRate = water[0];
+			scenario.waterLifetime = water[1];
+		}
+		else if (key == "visibility")
+		{ // visibility <alpha times size>
+			if (!line.numbers(1, &scenario.visibilityThreshold, 1))
+				return false;
+		}
+		else if (key == "grill")
+		{
+			float grill[4];
+			if (!line.numbers(1, grill, 4))
+				return false;
+			scenario.grillPos = glm::vec3(grill[0], grill[1], grill[2]);
+			scenario.grillRadius = grill[3];
+		}
+		else if (key == "preset")
+		{
+			if (numWords < 2)
+				return line.error("expected a preset name");
+			block = &presets[line.words[1]];
+			*block = ParticleSpawner();
+		}
+		else if (key == "spawner" || key == "scatter" || key == "spread")
+		{ // everything here places presets
+			int firstPreset = key == "spawner" ? 1 : 2;
+			ParticleSpawner used[2];
+			int numUsed = key == "spawner" ? 1 : 2;
+			for (int i = 0; i < numUsed; i++)
+			{
+				used[i] = ParticleSpawner();
+				if ((size_t)(firstPreset + i) >= numWords)
+				{
+					if (key == "spawner")
+						continue; // a spawner needn't start from a preset
+					return line.error("expected two presets");
+				}
+				std::map<std::string, ParticleSpawner>::iterator preset = presets.find(line.words[firstPreset + i]);
+				if (preset == presets.end())
+					return line.error("no preset called '" + line.words[firstPreset + i] + "'");
+				used[i] = preset->second;
+			}
+
+			float number = 0.0f;
+			if (key != "spawner" && !line.numbers(1, &number, 1))
+				return false;
+			if (key == "spread")
+			{ // spread <chance per second> <preset> <preset>
+				scenario.spreadRate = number;
+				scenario.spreadSpawners[0] = used[0];
+				scenario.spreadSpawners[1] = used[1];
+				continue;
+			}
+
+			if (!spawnersGiven)
+			{
+				scenario.numSpawners = 0;
+				spawnersGiven = true;
+			}
+			if (key == "spawner")
+			{ // spawner [preset] ... end
+				if (scenario.numSpawners >= maxSpawners)
+					return line.error("more than " + std::to_string(maxSpawners) + " spawners");
+				scenario.spawners[scenario.numSpawners] = used[0];
+				block = &scenario.spawners[scenario.numSpawners++];
+			}
+			else
+			{ // scatter <fires> <preset> <preset>, a pair per fire at random spots on the floor
+				Rng scatterRng;
+				scatterRng.seed(scenario.seed + line.lineNumber);
+				glm::vec3 inset = glm::vec3(0.5f, 0.0f, 0.5f);
+				glm::vec3 low = scenario.roomMin + inset, size = scenario.roomMax - scenario.roomMin - 2.0f * inset;
+				for (int i = 0; i < (int)number; i++)
+				{
+					if (scenario.numSpawners + 1 >= maxSpawners)
+						return line.error("more than " + std::to_string(maxSpawners) + " spawners");
+					glm::vec3 pos = glm::vec3(low[0] + scatterRng.uniform() * size[0], scenario.roomMin[1] + 0.5f, low[2] + scatterRng.uniform() * size[2]);
+					for (int j = 0; j < 2; j++)
+					{
+						scenario.spawners[scenario.numSpawners] = used[j];
+						scenario.spawners[scenario.numSpawners++].pos = pos;
+					}
+				}
+			}
+		}
+		else if (key == "at")
+		{ // at <seconds> water on <x y z> <dx dy dz>, at <seconds> water off
+			if (scenario.numEvents >= maxScenarioEvents)
+				return line.error("more than " + std::to_string(maxScenarioEvents) + " events");
+			ScenarioEvent e = ScenarioEvent();
+			if (!line.numbers(1, &e.time, 1))
+				return false;
+			if (numWords < 4 || line.words[2] != "water" || (line.words[3] != "on" && line.words[3] != "off"))
+				return line.error("expected 'water on' or 'water off'");
+			e.type = line.words[3] == "on" ? EVENT_WATER_ON : EVENT_WATER_OFF;
+			if (e.type == EVENT_WATER_ON)
+			{
+				float ray[6];
+				if (!line.numbers(4, ray, 6))
+					return false;
+				e.pos = glm::vec3(ray[0], ray[1], ray[2]);
+				e.dir = glm::normalize(glm::vec3(ray[3], ray[4], ray[5]));
+			}
+			scenario.events[scenario.numEvents++] = e;
+		}
+		else
+		{
+			return line.error("unknown key '" + key + "'");
+		}
+	}
+	if (block)
+		return lines.back().error("block is missing its 'end'");
+	return true;
+}
+
+// One field line inside a preset or spawner block
+bool parseSpawnerField(const ScenarioLine& line, ParticleSpawner& spawner)
+{
+	const std::string& key = line.key();
+	float value;
+	if (key == "pos")
+		return line.numbers(1, &spawner.pos[0], 3);
+	if (key == "dim")
+		return line.numbers(1, &spawner.dim[0], 3);
+	if (key == "startVel")
+		return line.numbers(1, &spawner.startVel[0], 3);
+	if (key == "startCol")
+		return line.numbers(1, &spawner.startCol[0], 4);
+	if (key == "endCol")
+		return line.numbers(1, &spawner.endCol[0], 4);
+	if (key == "velRange")
+		return line.numbers(1, &spawner.velRange, 1);
+	if (key == "lifetime")
+		return line.numbers(1, &spawner.particleLifetime, 1);
+	if (key == "size")
+		return line.numbers(1, &spawner.size, 1);
+	if (key == "wetness")
+		return line.numbers(1, &spawner.wetness, 1);
+	if (key == "rate")
+	{
+		if (!line.numbers(1, &value, 1))
+			return false;
+		spawner.particleRate = (int)value;
+		return true;
+	}
+	if (key == "sprite")
+	{
+		if (line.words.size() < 2 || (line.words[1] != "smoke" && line.words[1] != "droplet"))
+			return line.error("sprite is smoke or droplet");
+		spawner.sprite = line.words[1] == "smoke" ? SPRITE_SMOKE : SPRITE_DROPLET;
+		return true;
+	}
+	return line.error("unknown spawner field '" + key + "'");
+}
+
+// Copies the scenario's starting spawners and seed into the simulation
+void applyScenario()
+{
+	pools.reset(scenario.capacity);
+	numLooks = 0;
+	for (int i = 0; i < maxSpawners; i++)
+		spawnerContainer[i] = scenario.spawners[i];
+	numSpawners = scenario.numSpawners;
+	if (scenario.seed != 0)
+		rng.seed(scenario.seed);
+	// a spawner's starting wetness soaks its cell
+	field.init(scenario.roomMin, scenario.roomMax);
+	for (int i = 0; i < numSpawners; i++)
+	{
+		int cell = field.cellAt(spawnerContainer[i].pos);
+		field.moisture[cell] = std::max(field.moisture[cell], spawnerContainer[i].wetness * fieldSolver.getSettings().saturation);
+	}
+	fluid.setBounds(scenario.roomMin, scenario.roomMax);
+	fluid.setBowls(std::vector<glm::vec4>(1, glm::vec4(scenario.grillPos, scenario.grillRadius)));
+}
+
+// Drops the instances of every emitter whose bounds are outside the view and moves the rest to
+// the front of the arrays, filling slot and id for them. frame is the one the instances were
+// filled from, in the same order. Returns how many are left.
+int cullEmitters(const ParticleFrame& frame, const glm::mat4& viewProjection, std::vector<int>& slot, std::vector<unsigned int>& id, glm::vec4* posSize, glm::vec4* color, float* sprite)
+{
+	if (frame.groups.empty())
+	{
+		slot.assign(frame.slot.begin(), frame.slot.begin() + frame.count);
+		id.assign(frame.id.begin(), frame.id.begin() + frame.count);
+		return frame.count;
+	}
+	glm::vec4 planes[6];
+	frustumPlanes(viewProjection, planes);
+	slot.clear();
+	id.clear();
+	int count = 0;
+	for (const ParticleGroup& group : frame.groups)
+	{
+		if (!boxInFrustum(planes, group.boundsMin, group.boundsMax))
+			continue; // one test for the whole emitter
+		for (int i = group.first; i < group.first + group.count; i++)
+		{
+			posSize[count] = posSize[i];
+			color[count] = color[i];
+			sprite[count] = sprite[i];
+			slot.push_back(frame.slot[i]);
+			id.push_back(frame.id[i]);
+			count++;
+		}
+	}
+	return count;
+}
+
+// Sorts the instance arrays by distance to camera, far particles first. slot and id say which
+// particle each instance is, so the order can be followed between frames. Played back frames
+// have neither (slot and id NULL) and are sorted from scratch.
+void sortInstances(int count, const int* slot, const unsigned int* id, glm::vec4* posSize, glm::vec4* color, float* sprite)
+{
+	static std::vector<glm::vec4> sortedPosSize, sortedColor;
+	static std::vector<float> sortedSprite;
+	static std::vector<int> playbackOrder;
+	static std::vector<float> playbackDepth;
+	if (!slot)
+	{
+		playbackOrder.resize(count);
+		playbackDepth.resize(count);
+		for (int i = 0; i < count; i++)
+		{
+			playbackOrder[i] = i;
+			playbackDepth[i] = -glm::dot(glm::vec3(posSize[i]), cameraFront);
 		}
+		std::sort(playbackOrder.begin(), playbackOrder.end(), [](int a, int b) { return playbackDepth[a] < playbackDepth[b]; });
 	}
+	const std::vector<int>& order = slot ? depthSorter.sort(count, posSize, slot, id, cameraFront) : playbackOrder;
 
-	return -1; // All particles are taken, return -1
+	sortedPosSize.resize(count);
+	sortedColor.resize(count);
+	sortedSprite.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		int from = order[i];
+		sortedPosSize[i] = posSize[from];
+		sortedColor[i] = color[from];
+		sortedSprite[i] = sprite[from];
+	}
+	std::copy(sortedPosSize.begin(), sortedPosSize.end(), posSize);
+	std::copy(sortedColor.begin(), sortedColor.end(), color);
+	std::copy(sortedSprite.begin(), sortedSprite.end(), sprite);
+}
+
+// Puts the governor's new level into effect on the render side (the simulation picks up the rest
+// through SimInput) and reports it
+void applyQuality()
+{
+	const QualityLevel& quality = qualityLevels[governor.level()];
+	offscreenParticles.setScale(std::max(particleScale, quality.particleScale));
+	std::cout << "Quality " << governor.level() << "/" << governor.levels() - 1 << ": fire emission " << (int)(quality.emission * 100.0f)
+		<< "%, mesh LOD x" << quality.lodScale << ", particles at 1/" << offscreenParticles.getScale() << " resolution, water substeps <= "
+		<< quality.fluidSubsteps << " (frames cost " << governor.smoothedSeconds() * 1e3 << " ms against " << governor.targetSeconds() * 1e3 << ")" << std::endl;
 }
 
-void sortParticles()
+// Places the unit quad (corners at +-0.5) as a surface centered on center and spanning uAxis by vAxis,
+// then applies model. uvRepeat is how many times the texture tiles across each axis.
+SurfaceInstance makeSurface(const glm::mat4& model, glm::vec3 center, glm::vec3 uAxis, glm::vec3 vAxis, glm::vec2 uvRepeat, int layer)
 {
-	std::sort(&particleContainer[0], &particleContainer[maxParticles]);
+	glm::mat4 quadToSurface = glm::mat4(1.0f);
+	quadToSurface[0] = glm::vec4(uAxis, 0.0f);
+	quadToSurface[1] = glm::vec4(vAxis, 0.0f);
+	quadToSurface[2] = glm::vec4(glm::normalize(glm::cross(uAxis, vAxis)), 0.0f);
+	quadToSurface[3] = glm::vec4(center, 1.0f);
+
+	SurfaceInstance surface;
+	surface.model = model * quadToSurface;
+	surface.uvLayer = glm::vec4(uvRepeat[0], uvRepeat[1], (float)layer, 0.0f);
+	return surface;
 }
\ No newline at end of file
@@ -7,71 +7,121 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include "gl_ext.h"
+#include "programcache.h"
+
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <utility>
 
 class Shader
 {
 public:
-	unsigned int ID;
+	unsigned int ID = 0;
+	// empty shader, call build() once the sources are available
+	// ------------------------------------------------------------------------
+	Shader() {}
 	// constructor generates the shader on the fly
 	// ------------------------------------------------------------------------
 	Shader(const char* vertexPath, const char* fragmentPath)
 	{
-		// 1. retrieve the vertex/fragment source code from filePath
-		std::string vertexCode;
-		std::string fragmentCode;
-		std::ifstream vShaderFile;
-		std::ifstream fShaderFile;
+		build(readFile(vertexPath), readFile(fragmentPath));
+		isReady(true);
+	}
+	// retrieve the source code from filePath. Safe to call from any thread.
+	// ------------------------------------------------------------------------
+	static std::string readFile(const char* path)
+	{
+		std::string code;
+		std::ifstream shaderFile;
 		// ensure ifstream objects can throw exceptions:
-		vShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		fShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		shaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		try
 		{
-			// open files
-			vShaderFile.open(vertexPath);
-			fShaderFile.open(fragmentPath);
-			std::stringstream vShaderStream, fShaderStream;
-			// read file's buffer contents into streams
-			vShaderStream << vShaderFile.rdbuf();
-			fShaderStream << fShaderFile.rdbuf();
-			// close file handlers
-			vShaderFile.close();
-			fShaderFile.close();
-			// convert stream into string
-			vertexCode = vShaderStream.str();
-			fragmentCode = fShaderStream.str();
+			shaderFile.open(path);
+			std::stringstream shaderStream;
+			shaderStream << shaderFile.rdbuf();
+			shaderFile.close();
+			code = shaderStream.str();
 		}
-		catch (std::ifstream::failure e)
+		catch (std::ifstream::failure& e)
 		{
-			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
+			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ: " << path << std::endl;
 		}
+		return code;
+	}
+	// compile and link from source. Must run on the context thread. A cached program
+	// binary for these sources and this driver is tried first. Errors are not checked
+	// here so that with KHR_parallel_shader_compile the driver can work on several
+	// programs at once; isReady() reports them once linking has finished.
+	// ------------------------------------------------------------------------
+	void build(const std::string& vertexCode, const std::string& fragmentCode)
+	{
+		cacheKey = ProgramCache::key(vertexCode, fragmentCode);
+		ID = glCreateProgram();
+		if (ProgramCache::load(ID, cacheKey))
+		{
+			reflect();
+			linked = true;
+			return;
+		}
+		// binary missing or rejected, start over with a fresh program
+		glDeleteProgram(ID);
+
 		const char* vShaderCode = vertexCode.c_str();
 		const char * fShaderCode = fragmentCode.c_str();
-		// 2. compile shaders
-		unsigned int vertex, fragment;
 		// vertex shader
 		vertex = glCreateShader(GL_VERTEX_SHADER);
 		glShaderSource(vertex, 1, &vShaderCode, NULL);
 		glCompileShader(vertex);
-		checkCompileErrors(vertex, "VERTEX");
 		// fragment Shader
 		fragment = glCreateShader(GL_FRAGMENT_SHADER);
 		glShaderSource(fragment, 1, &fShaderCode, NULL);
 		glCompileShader(fragment);
-		checkCompileErrors(fragment, "FRAGMENT");
 		// shader Program
 		ID = glCreateProgram();
 		glAttachShader(ID, vertex);
 		glAttachShader(ID, fragment);
+		ProgramCache::prepare(ID);
 		glLinkProgram(ID);
+		linked = false;
+	}
+	// true once the program has finished linking. Never blocks unless wait is set
+	// or the driver lacks KHR_parallel_shader_compile.
+	// ------------------------------------------------------------------------
+	bool isReady(bool wait = false)
+	{
+		if (linked)
+			return true;
+		if (ID == 0)
+			return false;
+		if (!wait && glExt().parallelShaderCompile)
+		{
+			GLint done = GL_FALSE;
+			glGetProgramiv(ID, GL_COMPLETION_STATUS_KHR, &done);
+			if (!done)
+				return false;
+		}
+		checkCompileErrors(vertex, "VERTEX");
+		checkCompileErrors(fragment, "FRAGMENT");
 		checkCompileErrors(ID, "PROGRAM");
 		// delete the shaders as they're linked into our program now and no longer necessery
+		glDetachShader(ID, vertex);
+		glDetachShader(ID, fragment);
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
-
+		vertex = fragment = 0;
+		GLint success = GL_FALSE;
+		glGetProgramiv(ID, GL_LINK_STATUS, &success);
+		if (success)
+			ProgramCache::store(ID, cacheKey);
+		reflect();
+		linked = true;
+		return true;
 	}
 	// activate the shader
 	// ------------------------------------------------------------------------
@@ -79,66 +129,174 @@ public:
 	{
 		glUseProgram(ID);
 	}
+	// handle to a uniform. Ask for handles once at setup (before or after linking) and
+	// pass them to the setters, which then skip the name lookup entirely.
+	// ------------------------------------------------------------------------
+	struct Uniform
+	{
+		int slot = -1;
+	};
+	Uniform uniform(const std::string &name)
+	{
+		Uniform handle;
+		handle.slot = (int)handleLocations.size();
+		handleNames.push_back(name);
+		handleLocations.push_back(linked ? location(name) : -1);
+		return handle;
+	}
+	// location from the table built at link time, -1 if the uniform isn't active
+	GLint location(const std::string &name) const
+	{
+		std::unordered_map<std::string, GLint>::const_iterator it = locations.find(name);
+		return it == locations.end() ? -1 : it->second;
+	}
+	// every program that declares this uniform block gets it bound to binding when it links
+	// ------------------------------------------------------------------------
+	static void shareUniformBlock(const std::string &blockName, unsigned int binding)
+	{
+		sharedBlocks().push_back(std::make_pair(blockName, binding));
+	}
 	// utility uniform functions
 	// ------------------------------------------------------------------------
+	void setBool(Uniform u, bool value) const
+	{
+		glUniform1i(handleLocations[u.slot], (int)value);
+	}
 	void setBool(const std::string &name, bool value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+		glUniform1i(location(name), (int)value);
 	}
 	// ------------------------------------------------------------------------
+	void setInt(Uniform u, int value) const
+	{
+		glUniform1i(handleLocations[u.slot], value);
+	}
 	void setInt(const std::string &name, int value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1i(location(name), value);
 	}
 	// ------------------------------------------------------------------------
+	void setFloat(Uniform u, float value) const
+	{
+		glUniform1f(handleLocations[u.slot], value);
+	}
 	void setFloat(const std::string &name, float value) const
 	{
-		glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1f(location(name), value);
 	}
 	// ------------------------------------------------------------------------
+	void setVec2(Uniform u, const glm::vec2 &value) const
+	{
+		glUniform2fv(handleLocations[u.slot], 1, &value[0]);
+	}
 	void setVec2(const std::string &name, const glm::vec2 &value) const
 	{
-		glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform2fv(location(name), 1, &value[0]);
 	}
 	void setVec2(const std::string &name, float x, float y) const
 	{
-		glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+		glUniform2f(location(name), x, y);
+	}
+	void setVec2Array(Uniform u, const glm::vec2* values, int count) const
+	{
+		glUniform2fv(handleLocations[u.slot], count, &values[0][0]);
 	}
 	// ------------------------------------------------------------------------
+	void setVec3(Uniform u, const glm::vec3 &value) const
+	{
+		glUniform3fv(handleLocations[u.slot], 1, &value[0]);
+	}
 	void setVec3(const std::string &name, const glm::vec3 &value) const
 	{
-		glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform3fv(location(name), 1, &value[0]);
 	}
 	void setVec3(const std::string &name, float x, float y, float z) const
 	{
-		glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+		glUniform3f(location(name), x, y, z);
 	}
 	// ------------------------------------------------------------------------
+	void setVec4(Uniform u, const glm::vec4 &value) const
+	{
+		glUniform4fv(handleLocations[u.slot], 1, &value[0]);
+	}
 	void setVec4(const std::string &name, const glm::vec4 &value) const
 	{
-		glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform4fv(location(name), 1, &value[0]);
 	}
 	void setVec4(const std::string &name, float x, float y, float z, float w) const
 	{
-		glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+		glUniform4f(location(name), x, y, z, w);
 	}
 	// ------------------------------------------------------------------------
 	void setMat2(const std::string &name, const glm::mat2 &mat) const
 	{
-		glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat3(const std::string &name, const glm::mat3 &mat) const
 	{
-		glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
+	void setMat4(Uniform u, const glm::mat4 &mat) const
+	{
+		glUniformMatrix4fv(handleLocations[u.slot], 1, GL_FALSE, &mat[0][0]);
+	}
 	void setMat4(const std::string &name, const glm::mat4 &mat) const
 	{
-		glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 
 private:
+	unsigned int vertex = 0, fragment = 0;
+	bool linked = false;
+	uint64_t cacheKey = 0;
+	// active uniforms by name, filled once at link time
+	std::unordered_map<std::string, GLint> locations;
+	// locations behind the Uniform handles given out by uniform()
+	std::vector<std::string> handleNames;
+	std::vector<GLint> handleLocations;
+
+	static std::vector<std::pair<std::string, unsigned int>>& sharedBlocks()
+	{
+		static std::vector<std::pair<std::string, unsigned int>> blocks;
+		return blocks;
+	}
+	// build the location table, resolve handles and bind shared uniform blocks
+	// ------------------------------------------------------------------------
+	void reflect()
+	{
+		locations.clear();
+		GLint numUniforms = 0, maxNameLength = 0;
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &numUniforms);
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+		std::vector<GLchar> nameBuffer(maxNameLength > 0 ? maxNameLength : 1);
+		for (GLint i = 0; i < numUniforms; i++)
+		{
+			GLsizei length = 0;
+			GLint size;
+			GLenum type;
+			glGetActiveUniform(ID, (GLuint)i, (GLsizei)nameBuffer.size(), &length, &size, &type, nameBuffer.data());
+			std::string name(nameBuffer.data(), length);
+			GLint loc = glGetUniformLocation(ID, name.c_str());
+			if (loc < 0)
+				continue; // lives in a uniform block
+			locations[name] = loc;
+			// arrays are reported as "name[0]", also accept plain "name"
+			if (name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0)
+				locations[name.substr(0, name.size() - 3)] = loc;
+		}
+		for (size_t i = 0; i < handleNames.size(); i++)
+			handleLocations[i] = location(handleNames[i]);
+
+		for (const std::pair<std::string, unsigned int>& block : sharedBlocks())
+		{
+			GLuint index = glGetUniformBlockIndex(ID, block.first.c_str());
+			if (index != GL_INVALID_INDEX)
+				glUniformBlockBinding(ID, index, block.second);
+		}
+	}
+
 	// utility function for checking shader compilation/linking errors.
 	// ------------------------------------------------------------------------
 	void checkCompileErrors(GLuint shader, std::string type)
@@ -0,0 +1,214 @@
+#ifndef SIMTHREAD_H
+#define SIMTHREAD_H
+
+/// simthread.h
+/// runs the particle simulation on its own thread at a fixed tick, so a slow frame or a
+/// vsync wait no longer holds up the physics. Every tick fills a ParticleFrame that is
+/// published by swapping buffers; the render thread keeps the two newest frames and draws
+/// positions interpolated between them.
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <utility>
+#include <algorithm>
+
+// a run of a frame's particles that came from one emitter, and the box they stay inside
+// between the previous frame and this one
+struct ParticleGroup
+{
+	int first, count;
+	glm::vec3 boundsMin, boundsMax;
+};
+
+// alive particles after one tick, in container order (emitter by emitter when grouped)
+struct ParticleFrame
+{
+	double time = 0.0; // simulation time at the end of the tick
+	double publishedAt = 0.0; // wall clock seconds, for working out how far to interpolate
+	int count = 0;
+	std::vector<int> slot; // index in the particle container
+	std::vector<unsigned int> id; // tells a particle apart from a newer one reusing its slot
+	std::vector<glm::vec4> posSize, color;
+	std::vector<float> sprite; // left empty by scenes with a single sprite
+	std::vector<ParticleGroup> groups; // left empty by scenes that don't keep emitters apart
+
+	void resize(int n, bool withSprite)
+	{
+		slot.resize(n);
+		id.resize(n);
+		posSize.resize(n);
+		color.resize(n);
+		sprite.resize(withSprite ? n : 0);
+	}
+};
+
+// fills the instance arrays from current, with positions moved back towards previous by
+// 1 - alpha. Particles that only exist in current are drawn where they are. previous may be
+// NULL. slotLookup must be all -1 and at least as long as the particle container, it is
+// left that way.
+inline int interpolateFrames(const ParticleFrame* previous, const ParticleFrame& current, float alpha, std::vector<int>& slotLookup, glm::vec4* posSize, glm::vec4* color, float* sprite)
+{
+	if (previous)
+	{
+		for (int i = 0; i < previous->count; i++)
+			slotLookup[previous->slot[i]] = i;
+	}
+	for (int i = 0; i < current.count; i++)
+	{
+		glm::vec4 p = current.posSize[i];
+		int j = previous ? slotLookup[current.slot[i]] : -1;
+		if (j >= 0 && previous->id[j] == current.id[i])
+		{
+			glm::vec3 from = glm::vec3(previous->posSize[j]);
+			p = glm::vec4(from + (glm::vec3(p) - from) * alpha, p.w);
+		}
+		posSize[i] = p;
+		color[i] = current.color[i];
+		if (sprite)
+			sprite[i] = current.sprite.empty() ? 0.0f : current.sprite[i];
+	}
+	if (previous)
+	{
+		for (int i = 0; i < previous->count; i++)
+			slotLookup[previous->slot[i]] = -1;
+	}
+	return current.count;
+}
+
+// Input is whatever the simulation needs from the render thread (camera, held keys). It is
+// copied in once per tick, the simulation never reads it while the render thread writes.
+template<class Input>
+class SimulationThread
+{
+public:
+	typedef std::function<void(float dt, const Input& input, ParticleFrame& frame)> StepFunction;
+
+	~SimulationThread()
+	{
+		stop();
+	}
+
+	// step fills frame (time is already set) from the simulation state
+	// ------------------------------------------------------------------------
+	void start(float tickSeconds, StepFunction step)
+	{
+		tick = tickSeconds;
+		this->step = step;
+		running = true;
+		startTime = Clock::now();
+		worker = std::thread([this] { loop(); });
+	}
+	void stop()
+	{
+		if (!running)
+			return;
+		running = false;
+		worker.join();
+	}
+	bool isRunning() const
+	{
+		return running;
+	}
+	void setInput(const Input& in)
+	{
+		std::lock_guard<std::mutex> lock(inputMutex);
+		input = in;
+	}
+	// newest two frames and how far between them to draw. The frames stay valid until the
+	// next call. False until the first tick has been published.
+	// ------------------------------------------------------------------------
+	bool acquire(const ParticleFrame*& previous, const ParticleFrame*& current, float& alpha)
+	{
+		{
+			std::lock_guard<std::mutex> lock(publishMutex);
+			if (fresh)
+			{
+				std::swap(older, newest);
+				std::swap(newest, published);
+				fresh = false;
+				received++;
+			}
+		}
+		if (received == 0)
+			return false;
+		current = &newest;
+		previous = received > 1 ? &older : NULL;
+		alpha = 1.0f;
+		if (previous && newest.time > older.time)
+		{ // drawn one tick behind, so alpha runs 0 to 1 as the next tick is being computed
+			alpha = (float)((secondsSinceStart() - newest.publishedAt) / (newest.time - older.time));
+			alpha = std::min(std::max(alpha, 0.0f), 1.0f);
+		}
+		return true;
+	}
+	// run f between ticks, e.g. to save or restore the simulation state
+	// ------------------------------------------------------------------------
+	template<class F>
+	void paused(F f)
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		f();
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	StepFunction step;
+	float tick = 1.0f / 60.0f;
+	std::thread worker;
+	std::atomic<bool> running{ false };
+	Clock::time_point startTime;
+
+	std::mutex inputMutex, stateMutex, publishMutex;
+	Input input;
+	ParticleFrame back; // being filled by the simulation thread
+	ParticleFrame published; // newest tick, waiting for the render thread
+	ParticleFrame newest, older; // owned by the render thread
+	bool fresh = false;
+	int received = 0;
+
+	double secondsSinceStart() const
+	{
+		return std::chrono::duration<double>(Clock::now() - startTime).count();
+	}
+
+	void loop()
+	{
+		Clock::duration tickDuration = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(tick));
+		Clock::time_point next = Clock::now();
+		double simTime = 0.0;
+		while (running)
+		{
+			Input in;
+			{
+				std::lock_guard<std::mutex> lock(inputMutex);
+				in = input;
+			}
+			simTime += tick;
+			back.time = simTime;
+			{
+				std::lock_guard<std::mutex> lock(stateMutex);
+				step(tick, in, back);
+			}
+			back.publishedAt = secondsSinceStart();
+			{ // an unclaimed frame is simply replaced, the render thread only wants the newest
+				std::lock_guard<std::mutex> lock(publishMutex);
+				std::swap(back, published);
+				fresh = true;
+			}
+
+			next += tickDuration;
+			Clock::time_point now = Clock::now();
+			if (now - next > 5 * tickDuration)
+				next = now; // too far behind to catch up, slow down instead of spiralling
+			std::this_thread::sleep_until(next);
+		}
+	}
+};
+#endif
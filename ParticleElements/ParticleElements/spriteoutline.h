@@ -0,0 +1,152 @@
+#ifndef SPRITEOUTLINE_H
+#define SPRITEOUTLINE_H
+
+/// spriteoutline.h
+/// tight convex polygons around the visible part of each sprite, so a particle rasterizes
+/// only the texels that can show instead of its whole quad. The hull of every texel above
+/// the alpha threshold is cut down to a fixed number of vertices by repeatedly dropping the
+/// edge whose neighbours can be extended to meet at the least added area, so the polygon
+/// always still contains everything visible.
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+
+// every outline has this many vertices, drawn as a triangle fan. Shorter ones repeat their
+// last vertex, which only adds empty triangles.
+const int OUTLINE_VERTICES = 8;
+
+// the whole sprite, what an outline falls back to
+inline std::vector<glm::vec2> quadOutline()
+{
+	std::vector<glm::vec2> outline = { glm::vec2(0.0f, 0.0f), glm::vec2(1.0f, 0.0f), glm::vec2(1.0f, 1.0f), glm::vec2(0.0f, 1.0f) };
+	outline.resize(OUTLINE_VERTICES, outline.back());
+	return outline;
+}
+
+// area of a polygon, positive when counterclockwise
+inline float polygonArea(const std::vector<glm::vec2>& polygon)
+{
+	float area = 0.0f;
+	for (size_t i = 0; i < polygon.size(); i++)
+	{
+		const glm::vec2& a = polygon[i];
+		const glm::vec2& b = polygon[(i + 1) % polygon.size()];
+		area += a.x * b.y - b.x * a.y;
+	}
+	return 0.5f * area;
+}
+
+namespace outline_detail
+{
+	inline float cross(glm::vec2 o, glm::vec2 a, glm::vec2 b)
+	{
+		return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+	}
+
+	// Andrew's monotone chain, counterclockwise without collinear points
+	inline std::vector<glm::vec2> convexHull(std::vector<glm::vec2> points)
+	{
+		std::sort(points.begin(), points.end(), [](const glm::vec2& a, const glm::vec2& b) {
+			return a.x < b.x || (a.x == b.x && a.y < b.y);
+		});
+		if (points.size() < 3)
+			return points;
+		std::vector<glm::vec2> hull(2 * points.size());
+		size_t k = 0;
+		for (size_t i = 0; i < points.size(); i++)
+		{
+			while (k >= 2 && cross(hull[k - 2], hull[k - 1], points[i]) <= 0.0f)
+				k--;
+			hull[k++] = points[i];
+		}
+		for (size_t i = points.size() - 1, lower = k + 1; i > 0; i--)
+		{
+			while (k >= lower && cross(hull[k - 2], hull[k - 1], points[i - 1]) <= 0.0f)
+				k--;
+			hull[k++] = points[i - 1];
+		}
+		hull.resize(k - 1);
+		return hull;
+	}
+}
+
+// polygon in uv space ([0,1], v up like the texture) holding every texel of an rgba image
+// whose alpha is above threshold, padded by a texel so bilinear filtering at the edge isn't
+// cut off. Falls back to the quad when nothing smaller fits in OUTLINE_VERTICES.
+// ------------------------------------------------------------------------
+inline std::vector<glm::vec2> alphaOutline(const unsigned char* rgba, int width, int height, unsigned char threshold = 0)
+{
+	using namespace outline_detail;
+	// only the first and last visible texel of each row can be on the hull
+	std::vector<glm::vec2> points;
+	for (int y = 0; y < height; y++)
+	{
+		const unsigned char* row = rgba + (size_t)y * width * 4;
+		int first = -1, last = -1;
+		for (int x = 0; x < width; x++)
+		{
+			if (row[x * 4 + 3] > threshold)
+			{
+				if (first < 0)
+					first = x;
+				last = x;
+			}
+		}
+		if (first < 0)
+			continue;
+		float x0 = (float)std::max(first - 1, 0), x1 = (float)std::min(last + 2, width);
+		float y0 = (float)std::max(y - 1, 0), y1 = (float)std::min(y + 2, height);
+		points.push_back(glm::vec2(x0, y0));
+		points.push_back(glm::vec2(x0, y1));
+		points.push_back(glm::vec2(x1, y0));
+		points.push_back(glm::vec2(x1, y1));
+	}
+	std::vector<glm::vec2> polygon = convexHull(points);
+	if (polygon.size() < 3)
+		return quadOutline();
+	for (glm::vec2& p : polygon)
+		p /= glm::vec2((float)width, (float)height);
+
+	// drop edges until it fits, each time the one that grows the polygon least
+	const float slack = 1e-4f; // extended corners may land this far outside the sprite
+	while ((int)polygon.size() > OUTLINE_VERTICES)
+	{
+		int n = (int)polygon.size();
+		int best = -1;
+		float bestArea = 0.0f;
+		glm::vec2 bestCorner;
+		for (int i = 0; i < n; i++)
+		{ // edge a-b goes, the edges before a and after b are extended to meet
+			glm::vec2 before = polygon[(i + n - 1) % n], a = polygon[i];
+			glm::vec2 b = polygon[(i + 1) % n], after = polygon[(i + 2) % n];
+			glm::vec2 d1 = a - before, d2 = after - b;
+			float denom = d1.x * d2.y - d1.y * d2.x;
+			if (denom <= 1e-12f)
+				continue; // they don't meet on the outside
+			float t = ((b.x - a.x) * d2.y - (b.y - a.y) * d2.x) / denom;
+			if (t < 0.0f)
+				continue;
+			glm::vec2 corner = a + d1 * t;
+			if (corner.x < -slack || corner.y < -slack || corner.x > 1.0f + slack || corner.y > 1.0f + slack)
+				continue;
+			float added = 0.5f * cross(a, corner, b);
+			if (best < 0 || added < bestArea)
+			{
+				best = i;
+				bestArea = added;
+				bestCorner = glm::clamp(corner, glm::vec2(0.0f), glm::vec2(1.0f));
+			}
+		}
+		if (best < 0)
+			return quadOutline();
+		polygon[best] = bestCorner;
+		polygon.erase(polygon.begin() + (best + 1) % n);
+	}
+	if (polygonArea(polygon) >= 1.0f)
+		return quadOutline();
+	polygon.resize(OUTLINE_VERTICES, polygon.back());
+	return polygon;
+}
+#endif
@@ -1,11 +1,11 @@
 #version 330 core
 out vec4 FragColor;
 
-in vec2 TexCoord;
+in vec3 TexCoord;
 
-uniform sampler2D texture1;
+uniform sampler2DArray textures;
 
 void main()
 {
-	FragColor = texture(texture1, TexCoord);
+	FragColor = texture(textures, TexCoord);
 }
\ No newline at end of file
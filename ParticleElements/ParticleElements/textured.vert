@@ -1,15 +1,18 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
-layout (location = 1) in vec2 aTexCoord;
+layout (location = 1) in mat4 model; // per instance, uses locations 1-4
+layout (location = 5) in vec4 uvLayer; // per instance, uv repeats in xy and texture layer in z
 
-out vec2 TexCoord;
+out vec3 TexCoord;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+layout (std140) uniform Camera
+{
+	mat4 view;
+	mat4 projection;
+};
 
 void main()
 {
 	gl_Position = projection * view * model * vec4(aPos, 1.0);
-	TexCoord = aTexCoord;
+	TexCoord = vec3(aPos.xy * uvLayer.xy, uvLayer.z);
 }
\ No newline at end of file
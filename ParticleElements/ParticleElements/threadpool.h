@@ -0,0 +1,111 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/// threadpool.h
+/// fixed set of worker threads that run queued jobs. Used for asset loading and any
+/// work that can be split across cores.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+class ThreadPool
+{
+public:
+	// starts numThreads workers (at least one)
+	// ------------------------------------------------------------------------
+	explicit ThreadPool(unsigned int numThreads = std::thread::hardware_concurrency())
+	{
+		if (numThreads == 0)
+			numThreads = 1;
+		for (unsigned int i = 0; i < numThreads; i++)
+			workers.emplace_back([this] { workerLoop(); });
+	}
+	// finishes anything still queued, then joins the workers
+	// ------------------------------------------------------------------------
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			stopping = true;
+		}
+		queueCondition.notify_all();
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned int size() const
+	{
+		return (unsigned int)workers.size();
+	}
+	// queue a job, the returned future holds its result
+	// ------------------------------------------------------------------------
+	template<class F>
+	auto submit(F job) -> std::future<decltype(job())>
+	{
+		typedef decltype(job()) Result;
+		std::shared_ptr<std::packaged_task<Result()>> task = std::make_shared<std::packaged_task<Result()>>(std::move(job));
+		std::future<Result> result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			jobs.push([task] { (*task)(); });
+		}
+		queueCondition.notify_one();
+		return result;
+	}
+	// run body(begin, end) over [first, last) split into one chunk per worker.
+	// The calling thread takes the first chunk and returns once every chunk is done.
+	// ------------------------------------------------------------------------
+	template<class F>
+	void parallelFor(int first, int last, F body)
+	{
+		int count = last - first;
+		if (count <= 0)
+			return;
+		int numChunks = std::min(count, (int)workers.size() + 1);
+		int chunkSize = (count + numChunks - 1) / numChunks;
+
+		std::vector<std::future<void>> pending;
+		for (int start = first + chunkSize; start < last; start += chunkSize)
+		{
+			int end = std::min(start + chunkSize, last);
+			pending.push_back(submit([&body, start, end] { body(start, end); }));
+		}
+		body(first, std::min(first + chunkSize, last));
+		for (std::future<void>& f : pending)
+			f.get();
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> jobs;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stopping = false;
+
+	void workerLoop()
+	{
+		while (true)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueCondition.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (stopping && jobs.empty())
+					return;
+				job = std::move(jobs.front());
+				jobs.pop();
+			}
+			job();
+		}
+	}
+};
+#endif
@@ -0,0 +1,163 @@
+#ifndef VOXELFIELD_H
+#define VOXELFIELD_H
+
+/// voxelfield.h
+/// coarse grid of heat and moisture over the room, the medium fire and water interact
+/// through. Particles and spawners read and write their own cell in constant time, and
+/// each tick the field diffuses, cools, rises and dries with a stencil run over the
+/// thread pool one z slice per job.
+
+#include <glm/glm.hpp>
+
+#include "threadpool.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// plain data, so the field can sit in a snapshot with the rest of the simulation state
+template<int NX, int NY, int NZ>
+struct VoxelField
+{
+	static const int sizeX = NX, sizeY = NY, sizeZ = NZ;
+	static const int numCells = NX * NY * NZ;
+
+	glm::vec3 origin, cellSize;
+	float heat[numCells];
+	float moisture[numCells];
+
+	// covers the box from min to max, everything starts cold and dry
+	// ------------------------------------------------------------------------
+	void init(glm::vec3 min, glm::vec3 max)
+	{
+		origin = min;
+		cellSize = (max - min) / glm::vec3((float)NX, (float)NY, (float)NZ);
+		std::fill(heat, heat + numCells, 0.0f);
+		std::fill(moisture, moisture + numCells, 0.0f);
+	}
+	// cell holding p, points outside the box use the nearest edge cell
+	glm::ivec3 coordAt(glm::vec3 p) const
+	{
+		glm::ivec3 c = glm::ivec3(glm::floor((p - origin) / cellSize));
+		return glm::clamp(c, glm::ivec3(0), glm::ivec3(NX - 1, NY - 1, NZ - 1));
+	}
+	static int index(int x, int y, int z)
+	{
+		return (z * NY + y) * NX + x;
+	}
+	int cellAt(glm::vec3 p) const
+	{
+		glm::ivec3 c = coordAt(p);
+		return index(c.x, c.y, c.z);
+	}
+	glm::vec3 cellCenter(int x, int y, int z) const
+	{
+		return origin + (glm::vec3((float)x, (float)y, (float)z) + 0.5f) * cellSize;
+	}
+};
+
+struct VoxelFieldSettings
+{
+	float heatDiffusion = 0.3f; // m^2/s
+	float moistureDiffusion = 0.05f; // m^2/s, damp spreads much slower than heat
+	float cooling = 0.2f; // fraction of its heat a cell loses each second
+	float rise = 0.2f; // m/s hot air carries heat upwards
+	float evaporation = 1.0f; // moisture lost per second per unit of heat
+	float quenching = 1.0f; // extra cooling per second per unit of saturation
+	float saturation = 500.0f; // moisture at which a cell counts as soaked
+};
+
+class VoxelFieldSolver
+{
+public:
+	VoxelFieldSolver() {}
+	VoxelFieldSolver(const VoxelFieldSolver&) = delete;
+	VoxelFieldSolver& operator=(const VoxelFieldSolver&) = delete;
+
+	void init(ThreadPool& pool, const VoxelFieldSettings& settings = VoxelFieldSettings())
+	{
+		this->pool = &pool;
+		this->settings = settings;
+	}
+	const VoxelFieldSettings& getSettings() const
+	{
+		return settings;
+	}
+	// advances the field by dt, split into as many explicit steps as diffusion needs to
+	// stay stable on this grid
+	// ------------------------------------------------------------------------
+	template<int NX, int NY, int NZ>
+	void step(VoxelField<NX, NY, NZ>& field, float dt)
+	{
+		const int numCells = VoxelField<NX, NY, NZ>::numCells;
+		heat.resize(numCells);
+		moisture.resize(numCells);
+
+		glm::vec3 size = field.cellSize;
+		float minSize2 = std::min(std::min(size.x * size.x, size.y * size.y), size.z * size.z);
+		float fastest = std::max(settings.heatDiffusion, settings.moistureDiffusion) / minSize2;
+		// explicit 3D diffusion is stable for rate * dt <= 1/6, rising is upwind and needs
+		// rise * dt <= cell height
+		float stableStep = 1.0f / (6.0f * fastest + settings.rise / size.y + 1e-6f);
+		int substeps = std::max((int)std::ceil(dt / stableStep), 1);
+		float h = dt / substeps;
+
+		glm::vec3 heatRate = settings.heatDiffusion / (size * size);
+		glm::vec3 moistureRate = settings.moistureDiffusion / (size * size);
+		float riseRate = settings.rise / size.y;
+		for (int s = 0; s < substeps; s++)
+		{
+			pool->parallelFor(0, NZ, [&](int zBegin, int zEnd) {
+				for (int z = zBegin; z < zEnd; z++)
+					for (int y = 0; y < NY; y++)
+						for (int x = 0; x < NX; x++)
+							updateCell(field, x, y, z, h, heatRate, moistureRate, riseRate);
+			});
+			std::copy(heat.begin(), heat.end(), field.heat);
+			std::copy(moisture.begin(), moisture.end(), field.moisture);
+		}
+	}
+
+private:
+	ThreadPool* pool = NULL;
+	VoxelFieldSettings settings;
+	std::vector<float> heat, moisture; // next values, copied back once every cell is done
+
+	// 7 point stencil, edges only exchange with the neighbours they have so nothing leaks out
+	template<int NX, int NY, int NZ>
+	void updateCell(const VoxelField<NX, NY, NZ>& field, int x, int y, int z, float dt, glm::vec3 heatRate, glm::vec3 moistureRate, float riseRate)
+	{
+		typedef VoxelField<NX, NY, NZ> Field;
+		int i = Field::index(x, y, z);
+		float h = field.heat[i], m = field.moisture[i];
+		float dh = 0.0f, dm = 0.0f;
+		const int offsets[3] = { 1, NX, NX * NY };
+		const int coords[3] = { x, y, z };
+		const int sizes[3] = { NX, NY, NZ };
+		for (int a = 0; a < 3; a++)
+		{
+			if (coords[a] > 0)
+			{
+				dh += heatRate[a] * (field.heat[i - offsets[a]] - h);
+				dm += moistureRate[a] * (field.moisture[i - offsets[a]] - m);
+			}
+			if (coords[a] < sizes[a] - 1)
+			{
+				dh += heatRate[a] * (field.heat[i + offsets[a]] - h);
+				dm += moistureRate[a] * (field.moisture[i + offsets[a]] - m);
+			}
+		}
+		// heat carried up out of this cell and in from the one below, the ceiling keeps it
+		if (y < NY - 1)
+			dh -= riseRate * h;
+		if (y > 0)
+			dh += riseRate * field.heat[i - NX];
+
+		float wet = std::min(m / settings.saturation, 1.0f);
+		dh -= (settings.cooling + settings.quenching * wet) * h;
+		dm -= settings.evaporation * h;
+		heat[i] = std::max(h + dh * dt, 0.0f);
+		moisture[i] = std::max(m + dm * dt, 0.0f);
+	}
+};
+#endif
@@ -16,6 +16,28 @@
 // image loading
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb/stb_image_write.h>
+// rendering to an image sequence
+#include "threadpool.h"
+#include "framecapture.h"
+// saving and restoring the simulation
+#include "random.h"
+#include "snapshot.h"
+// recording and replaying particle frames
+#include "recording.h"
+// simulation on its own thread
+#include "simthread.h"
+// scenario files
+#include "scenario.h"
+// culling and drawing instances on the gpu
+#include "gpucull.h"
+#include "timingwheel.h"
+#include "hugepagearena.h"
+// frame time percentiles for --benchmark
+#include "benchmark.h"
+// quality steps that hold --target-fps
+#include "governor.h"
 
 
 // Functions ---------------------------------
@@ -23,8 +45,17 @@
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 int findUnusedParticle();
+struct SimInput;
+void stepSimulation(float dt, const SimInput& input, ParticleFrame& frame);
+void spawnParticles(float dt);
+int simulateParticles(float dt);
+struct Scenario;
+bool parseScenario(const std::vector<ScenarioLine>& lines, Scenario& scenario);
+void applyScenario();
 void sortParticles();
+void rebuildLifetimes();
 
 // Global variables ---------------------------
 
@@ -40,23 +71,31 @@ float yaw = 0.0f, pitch = 0.0f;
 bool firstMouse = true;
 float lastX = 400, lastY = 300;
 
+// --benchmark 600 (frames) or 30s runs without vsync and prints frame, CPU and GPU time percentiles
+Benchmark benchmark;
+// times every frame, for the benchmark and the governor, while either is on
+FrameTimer frameTimer;
+
+// --target-fps 60 spawns a smaller fraction of the particles while frames cost more than 1/60 s,
+// and more again when they have room, printing each change. The ramping spawn rate is what
+// outgrows a slower machine, so emission is the one thing traded here.
+const float qualityEmission[] = { 1.0f, 0.75f, 0.5f, 0.35f, 0.25f, 0.15f };
+const int numQualityLevels = sizeof(qualityEmission) / sizeof(qualityEmission[0]);
+QualityGovernor governor;
+double targetFps = 0.0;
+
 // time
 float deltaTime = 0.0f;	// Time between current frame and last frame
 float lastFrame = 0.0f; // Time of last frame
-float elapsedTime = 0.0f; // Total time of simulation thus far
-
-// particle spawner
-glm::vec3 spawnerPos = glm::vec3(0.0f, 0.0f, 0.0f);
-glm::vec3 spawnerDim = glm::vec3(10.0f, 10.0f, 10.0f);
-glm::vec3 spawnerDir = glm::vec3(0.0f, 0.0f, 0.0f);
 
 // particles
 struct Particle { // Struct for cpu - data is pushed into buffers for gpu to use
 	glm::vec3 pos, vel;
 	float r, g, b, a;
 	float size;
-	float life  = -1.0f; // Remaining life of the particle. < 0 = dead/unused.
+	uint32_t expiryTick = 0; // Tick the particle dies at the start of. 0 = dead/unused.
 	float cameraDist = -INFINITY;
+	unsigned int id; // new for every spawn, so a reused slot isn't mistaken for the same particle
 
 	bool operator<(Particle& that) 
 	{
@@ -65,14 +104,79 @@ struct Particle { // Struct for cpu - data is pushed into buffers for gpu to use
 	}
 };
 const int maxParticles = 100000;
-Particle particleContainer[maxParticles];
-const int particleRate = 1000; // number of particles spawned each second
-int lastUsedParticle = 0;
-float particleLifetime = 120.0;
-//glm::vec3 startVel = spawnerDir * 4.0f;
-glm::vec3 startVel = glm::vec3(10.0f, 0.0f, 0.0f);
-float minSize = 0.1;
-float maxSize = 0.5;
+
+// Everything the simulation needs to carry on, kept in one block so a snapshot is a single copy
+struct SimulationState {
+	Particle particles[maxParticles];
+	int lastUsedParticle = 0;
+	float elapsedTime = 0.0f; // Total time of simulation thus far
+	uint32_t tick = 0; // Ticks simulated thus far
+
+	// particle spawner
+	glm::vec3 spawnerPos = glm::vec3(0.0f, 0.0f, 0.0f);
+	glm::vec3 spawnerDim = glm::vec3(10.0f, 10.0f, 10.0f);
+	glm::vec3 spawnerDir = glm::vec3(0.0f, 0.0f, 0.0f);
+	float particleLifetime = 120.0;
+	//glm::vec3 startVel = spawnerDir * 4.0f;
+	glm::vec3 startVel = glm::vec3(10.0f, 0.0f, 0.0f);
+
+	unsigned int nextParticleId = 0;
+	Rng rng;
+};
+// The state and the instance staging arrays are carved from one arena, on huge pages where the
+// system gives them (the page size obtained is reported at startup)
+HugePageArena particleArena(sizeof(SimulationState) + maxParticles * 2 * sizeof(glm::vec4) + 4 * 64);
+SimulationState& sim = *particleArena.create<SimulationState>();
+Particle (&particleContainer)[maxParticles] = sim.particles;
+int& lastUsedParticle = sim.lastUsedParticle;
+float& elapsedTime = sim.elapsedTime;
+uint32_t& simTick = sim.tick;
+glm::vec3& spawnerPos = sim.spawnerPos;
+glm::vec3& spawnerDim = sim.spawnerDim;
+glm::vec3& spawnerDir = sim.spawnerDir;
+float& particleLifetime = sim.particleLifetime;
+glm::vec3& startVel = sim.startVel;
+unsigned int& nextParticleId = sim.nextParticleId;
+Rng& rng = sim.rng;
+
+// Lifetimes. Every particle is filed in the wheel under its expiry tick when it spawns, so
+// each tick retires one bucket instead of every particle counting down. Slots freed that
+// way are handed to findUnusedParticle first. Neither is saved, rebuildLifetimes() makes
+// them again from the particles' expiry ticks.
+TimingWheel lifetimes;
+std::vector<TimingWheel::Entry> expired;
+std::vector<int> freeSlots;
+
+// Scenario, the setup a run starts from. The defaults are the original galaxy, --scenario loads
+// one from a file (see default.scn for the format).
+struct Scenario {
+	int capacity = maxParticles; // most particles alive at once, can't exceed maxParticles
+	uint64_t seed = 0; // 0 keeps the generator's own default
+	int particleRate = 1000; // number of particles spawned each second
+	float minSize = 0.1f, maxSize = 0.5f;
+	float spawnUntil = 100.0f; // seconds before the spawner shuts off
+	float particleLifetime = 120.0f;
+	glm::vec3 spawnerPos = glm::vec3(0.0f, 0.0f, 0.0f);
+	glm::vec3 spawnerDim = glm::vec3(10.0f, 10.0f, 10.0f);
+	glm::vec3 startVel = glm::vec3(10.0f, 0.0f, 0.0f);
+};
+Scenario scenario;
+const char* scenarioPath = NULL;
+
+// snapshots
+const uint32_t SCENE_ID = 0x59584C47; // "GLXY"
+const char* snapshotPath = "galaxy.snap"; // F5 saves here, F9 restores
+
+// recording, --record writes every frame out, --playback replays a file instead of simulating
+FrameRecorder recorder;
+FramePlayback playback;
+const float playbackSeekStep = 5.0f; // seconds per left/right arrow press
+
+// offline rendering, --offline <pattern> renders --frames frames at a fixed timestep into
+// an image sequence, with no visible window
+const char* offlinePattern = NULL;
+int offlineFrames = 600;
+const float offlineTimestep = 1.0f / 60.0f;
 
 
 // physics
@@ -82,8 +186,71 @@ glm::vec3 grav = glm::vec3(0.0f, 0.0f, 0.0f);
 // Display
 const bool ADDITIVE = true;
 
-int main()
+// simulation thread, ticks at a fixed rate independent of the frame rate. The camera reaches
+// it only through SimInput, copied in once per tick.
+struct SimInput {
+	glm::vec3 cameraFront;
+	float emission; // from the current quality level
+};
+SimInput simInput; // the current tick's copy, only touched by the simulation
+SimulationThread<SimInput> simThread;
+const float simTickSeconds = 1.0f / 60.0f;
+
+int main(int argc, char** argv)
 {
+	particleArena.report("Particle memory");
+
+	// command line
+	bool restoreAtStart = false;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--restore" && i + 1 < argc)
+		{ // start from a saved snapshot, e.g. just before the interesting part of a long run
+			snapshotPath = argv[++i];
+			restoreAtStart = true;
+		}
+		else if (arg == "--scenario" && i + 1 < argc)
+		{ // e.g. --scenario dense.scn, or its compiled dense.scnb
+			scenarioPath = argv[++i];
+		}
+		else if (arg == "--record" && i + 1 < argc)
+		{
+			recorder.open(argv[++i], maxParticles);
+		}
+		else if (arg == "--playback" && i + 1 < argc)
+		{
+			playback.open(argv[++i]);
+		}
+		else if (arg == "--offline" && i + 1 < argc)
+		{ // e.g. --offline frames/frame_%05d.png
+			offlinePattern = argv[++i];
+		}
+		else if (arg == "--frames" && i + 1 < argc)
+		{
+			offlineFrames = atoi(argv[++i]);
+		}
+		else if (arg == "--benchmark" && i + 1 < argc)
+		{
+			if (!benchmark.init(argv[++i]))
+				return -1;
+		}
+		else if (arg == "--target-fps" && i + 1 < argc)
+		{
+			targetFps = atof(argv[++i]);
+		}
+	}
+
+	// spawner settings come from the scenario, a snapshot then carries on from wherever it was taken
+	if (scenarioPath)
+		loadScenario(scenarioPath, SCENE_ID, scenario, parseScenario);
+	applyScenario();
+	if (restoreAtStart)
+	{
+		loadSnapshot(snapshotPath, SCENE_ID, sim);
+		rebuildLifetimes();
+	}
+
 	// Before loop starts ---------------------
 	// glfw init
 	glfwInit();
@@ -92,18 +259,53 @@ int main()
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 	// glfw window creation
-	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "5611 HW1", NULL, NULL);
+	GLFWwindow* window;
+	if (offlinePattern)
+	{
+		window = createOffscreenWindow(SCR_WIDTH, SCR_HEIGHT, "5611 HW1");
+		if (!window)
+		{
+			glfwTerminate();
+			return -1;
+		}
+	}
+	else
+	{
+		window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "5611 HW1", NULL, NULL);
+	}
 	glfwMakeContextCurrent(window);
 
 	// register callbacks
 	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 	//Register mouse movement callback
 	glfwSetCursorPosCallback(window, mouse_callback);
+	glfwSetKeyCallback(window, key_callback);
 
 	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
 	// Initialize glad
 	gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+	loadGLExtensions((GLADloadproc)glfwGetProcAddress);
+
+	// a benchmark measures how fast frames can go, not the display's refresh rate
+	if (benchmark.enabled())
+	{
+		glfwSwapInterval(0);
+		benchmark.start();
+	}
+	// offline renders take as long as they take, at full quality
+	governor.init(targetFps > 0.0 && !offlinePattern ? 1.0 / targetFps : 0.0, numQualityLevels);
+	if (benchmark.enabled() || governor.enabled())
+		frameTimer.start();
+
+	// offline renders draw into an FBO, frames are encoded on the pool
+	ThreadPool threadPool;
+	FrameCapture frameCapture(threadPool);
+	if (offlinePattern && !frameCapture.init(SCR_WIDTH, SCR_HEIGHT, offlinePattern))
+	{
+		glfwTerminate();
+		return -1;
+	}
 
 	glEnable(GL_CULL_FACE);
 	glEnable(GL_BLEND);
@@ -122,8 +324,8 @@ int main()
 		// Particles
 
 		// allocate mem for particle data
-		static glm::vec4* particlePositionData = new glm::vec4[maxParticles];
-		static glm::vec4* particleColorData = new glm::vec4[maxParticles];
+		static glm::vec4* particlePositionData = particleArena.createArray<glm::vec4>(maxParticles);
+		static glm::vec4* particleColorData = particleArena.createArray<glm::vec4>(maxParticles);
 
 		// VBO for particle position and size
 		unsigned int particle_position_buffer;
@@ -192,161 +394,58 @@ int main()
 		particleShader.use();
 		particleShader.setInt("texture1", 0);
 
+		// frustum culling compacts the instances in whatever order they finish, which only
+		// additive blending doesn't notice. Without compute the instances are drawn as they are.
+		InstanceCuller culler;
+		bool gpuCulling = ADDITIVE && culler.init("cull.comp", maxParticles, particle_vertex_buffer);
+
 	// uncomment this call to draw in wireframe polygons.
 	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
+	// simulation runs on its own thread unless replaying or rendering offline
+	static std::vector<int> slotLookup(maxParticles, -1);
+	ParticleFrame offlineFrame;
+	if (!playback.isOpen() && !offlinePattern)
+		simThread.start(simTickSeconds, stepSimulation);
+
 	// render loop ----------------------------
 	while (!glfwWindowShouldClose(window))
 	{
+		frameTimer.beginFrame();
+
 		// Set deltaT
-		float currentFrame = glfwGetTime();
+		float currentFrame = offlinePattern ? lastFrame + offlineTimestep : (float)glfwGetTime();
 		deltaTime = currentFrame - lastFrame;
 		lastFrame = currentFrame;
 
-		elapsedTime += deltaTime;
-
 		// input
 		processInput(window);
 
 		// processing
 
-		// determine # of particles to spawn
-		int toSpawn = (int)(deltaTime*particleRate);
-		toSpawn *= elapsedTime / 10.0f;
-
-		float r = ((float)rand() / RAND_MAX);
-		if (r < (deltaTime*particleRate - (float)toSpawn))
-		{ // use non-integers to determine chance of spawning particle
-			toSpawn++;
+		int numParticles; // number of particles actually existing right now
+		if (playback.isOpen())
+		{ // replay recorded frames instead of simulating
+			numParticles = playback.advance(deltaTime, maxParticles, particlePositionData, particleColorData, NULL);
 		}
-		// spawn new particles
-		if (elapsedTime < 100)
-		{
-			for (int i = 0; i < toSpawn; i++)
-			{
-				int index = findUnusedParticle();
-				if (index >= 0)
-				{
-					Particle& p = particleContainer[index];
-
-					p.life = particleLifetime;
-					float offX = spawnerDim[0] * ((float)rand() / RAND_MAX);
-					float posX = spawnerPos[0] - (spawnerDim[0] / 2.0f) + offX;
-					float offY = spawnerDim[1] * ((float)rand() / RAND_MAX);
-					float posY = spawnerPos[1] - (spawnerDim[1] / 2.0f) + offY;
-					float offZ = spawnerDim[2] * ((float)rand() / RAND_MAX);
-					float posZ = spawnerPos[2] - (spawnerDim[2] / 2.0f) + offZ;
-					p.pos = glm::vec3(posX, posY, posZ);
-
-					float rTheta = ((float)rand() / RAND_MAX) * 4.0f - 2.0f;
-					float rPhi = ((float)rand() / RAND_MAX) * 4.0f - 2.0f;
-					float rMag = ((float)rand() / RAND_MAX) * 2.0f;
-
-					glm::mat4 rot = glm::mat4(1.0f);
-					rot = glm::rotate(rot, glm::radians(rTheta), glm::vec3(0.0f, 1.0f, 0.0f));
-					rot = glm::rotate(rot, glm::radians(rPhi), glm::vec3(0.0f, 0.0f, 1.0f));
-
-					p.vel = glm::vec3(rot * glm::vec4(rMag * startVel, 1.0f));
-
-					p.r = ((float)rand() / RAND_MAX);
-					p.g = ((float)rand() / RAND_MAX);
-					p.b = ((float)rand() / RAND_MAX);
-					p.a = ((float)rand() / RAND_MAX);
-
-					p.size = (maxSize - minSize) * ((float)rand() / RAND_MAX);
-
-					//p.cameraDist = glm::dot(p.pos, cameraFront);
-				}
-			}
-		}
-
-		// simulate particles on cpu
-		int numParticles = 0; // number of particles actually existing right now
-		for (int i = 0; i < maxParticles; i++)
+		else
 		{
-			Particle& p = particleContainer[i];
-			if (p.life > 0.0f)
-			{ // For each currently alive particle
-				//numParticles++;
-				p.life -= deltaTime;
-				if (p.life > 0.0f)
-				{ // If the particle didn't die this frame
-					if (elapsedTime < 88.0)
-					{ //Spin and compress for 90 seconds
-						// Integrate acceleration and velocity using eularian integration
-						//p.vel += (-glm::normalize(p.pos) * 15.0f * deltaTime / glm::length(p.pos));
-						//p.pos += p.vel * deltaTime;
-
-						// Convert to polar
-						float r = sqrtf(p.pos[0] * p.pos[0] + p.pos[2] * p.pos[2]);
-						float theta = atan2f(p.pos[2], p.pos[0]);
-
-						float tMod = 5.0f / (r*r + 1) * elapsedTime / 20.0;
-						float rMod = 3.0f / (r + 1) * elapsedTime / 20.0;
-
-						theta += deltaTime * tMod;
-						r += deltaTime * -0.1f * exp(-0.1f * theta) * rMod;
-
-						// Convert back to cartesian
-						float x = r * cos(theta);
-						float z = r * sin(theta);
-
-						float yMod = 0.15 * elapsedTime / 15.0;
-
-						float y = p.pos[1] + (r - p.pos[1]) * deltaTime * yMod;//y = p.pos[1] blended with z = r
-
-						p.pos = glm::vec3(x, y, z);
-
-						if (p.r < 1.0f)
-						{
-							p.r += deltaTime / 88.0f;
-						}
-						if (p.g < 1.0f)
-						{
-							p.g += deltaTime / 88.0f;
-						}
-						if (p.b < 0.4f)
-						{
-							p.b += deltaTime / 88.0f;
-						}
-						else
-						{
-							p.b -= deltaTime / 88.0f;
-						}
-					}
-					else
-					{
-						if (p.life < elapsedTime*elapsedTime - 8070.0f)
-						{
-							p.pos += p.vel * deltaTime;
-						}
-					}
-
-
-					p.cameraDist = glm::dot(p.pos, cameraFront);
-				}
-				else
-				{
-					// This particle just died
-					p.cameraDist = -INFINITY;
-				}
-				numParticles++;
+			SimInput input = { cameraFront, qualityEmission[governor.level()] };
+			numParticles = 0;
+			if (offlinePattern)
+			{ // step in lockstep with the frames so renders repeat exactly
+				offlineFrame.time += offlineTimestep;
+				stepSimulation(offlineTimestep, input, offlineFrame);
+				numParticles = interpolateFrames(NULL, offlineFrame, 1.0f, slotLookup, particlePositionData, particleColorData, NULL);
 			}
-		}
-
-		std::cout << numParticles << std::endl;
-
-		// Sort particles by distance to camera
-		//sortParticles();
-
-		// put info into arrays for gpu
-		for (int i = 0; i < numParticles; i++)
-		{
-			Particle& p = particleContainer[i];
-			if (p.life > 0.0f)
-			{ // For each currently alive particle
-				particlePositionData[i] = glm::vec4(p.pos, p.size);
-				particleColorData[i] = glm::vec4(p.r, p.g, p.b, p.a);
+			else
+			{
+				simThread.setInput(input);
+				const ParticleFrame* previous;
+				const ParticleFrame* current;
+				float alpha;
+				if (simThread.acquire(previous, current, alpha))
+					numParticles = interpolateFrames(previous, *current, alpha, slotLookup, particlePositionData, particleColorData, NULL);
 			}
 		}
 		
@@ -361,6 +460,8 @@ int main()
 		glBufferSubData(GL_ARRAY_BUFFER, 0, numParticles * sizeof(GLfloat) * 4, particleColorData);
 
 		// rendering commands here
+		if (offlinePattern)
+			frameCapture.bind();
 		glClearColor(0.1f, 0.1f, 0.15f, 1.0f);
 		if (ADDITIVE)
 		{
@@ -380,24 +481,54 @@ int main()
 		
 
 		// particles
-		glBindVertexArray(particle_VAO);
+		if (gpuCulling)
+			culler.cull(particle_position_buffer, particle_color_buffer, numParticles, projection * view);
+		particleShader.use();
 		particleShader.setMat4("view", view);
 		particleShader.setMat4("projection", projection);
 
-		glVertexAttribDivisor(0, 0); // particles vertices : always reuse the same 4 vertices -> 0
-		glVertexAttribDivisor(1, 1); // positions : one per quad (its center)                 -> 1
-		glVertexAttribDivisor(2, 1); // color : one per quad                                  -> 1
+		if (gpuCulling)
+		{
+			culler.draw();
+		}
+		else
+		{
+			glBindVertexArray(particle_VAO);
+			glVertexAttribDivisor(0, 0); // particles vertices : always reuse the same 4 vertices -> 0
+			glVertexAttribDivisor(1, 1); // positions : one per quad (its center)                 -> 1
+			glVertexAttribDivisor(2, 1); // color : one per quad                                  -> 1
+
+			glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, numParticles);
+		}
 
-		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, numParticles);
+		if (offlinePattern)
+		{
+			frameCapture.capture();
+			if (frameCapture.framesCaptured() >= offlineFrames)
+				glfwSetWindowShouldClose(window, true);
+		}
+
+		bool measured = frameTimer.endFrame();
+		benchmark.record(frameTimer, measured);
+		if (measured && governor.update(std::max(frameTimer.cpuSeconds(), frameTimer.latestGpuSeconds()), frameTimer.intervalSeconds()))
+		{
+			std::cout << "Quality " << governor.level() << "/" << governor.levels() - 1 << ": emission " << (int)(qualityEmission[governor.level()] * 100.0f)
+				<< "% (frames cost " << governor.smoothedSeconds() * 1e3 << " ms against " << governor.targetSeconds() * 1e3 << ")" << std::endl;
+		}
+		if (benchmark.finished())
+			glfwSetWindowShouldClose(window, true);
 
 		// check and call events and swap the buffers
 		glfwPollEvents();
 		glfwSwapBuffers(window);
 	}
 
-	free(particlePositionData);
-	free(particleColorData);
-
+	simThread.stop();
+	recorder.close();
+	frameCapture.finish();
+	frameTimer.finish();
+	benchmark.record(frameTimer, false);
+	benchmark.report();
 	glfwTerminate();
 	
 	return 0;
@@ -426,6 +557,39 @@ void processInput(GLFWwindow *window)
 		cameraPos += glm::normalize(glm::cross(cameraFront, cameraUp)) * cameraSpeed;
 }
 
+// Discrete key presses
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (action != GLFW_PRESS)
+		return;
+
+	if (key == GLFW_KEY_F5)
+	{
+		simThread.paused([] {
+			if (saveSnapshot(snapshotPath, SCENE_ID, sim))
+				std::cout << "Saved snapshot " << snapshotPath << std::endl;
+		});
+	}
+	else if (key == GLFW_KEY_F9)
+	{
+		simThread.paused([] {
+			if (loadSnapshot(snapshotPath, SCENE_ID, sim))
+			{
+				rebuildLifetimes();
+				std::cout << "Restored snapshot " << snapshotPath << std::endl;
+			}
+		});
+	}
+	else if (key == GLFW_KEY_LEFT && playback.isOpen())
+	{
+		playback.seek(playback.time() - playbackSeekStep);
+	}
+	else if (key == GLFW_KEY_RIGHT && playback.isOpen())
+	{
+		playback.seek(playback.time() + playbackSeekStep);
+	}
+}
+
 void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 {
 	if (firstMouse)
@@ -462,18 +626,26 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 // Finds a particle in particleContainer which isn't used yet.
 int findUnusedParticle()
 {
-	for (int i = lastUsedParticle; i < maxParticles; i++)
+	while (!freeSlots.empty())
+	{ // slots the wheel retired, unless one was taken since
+		int i = freeSlots.back();
+		freeSlots.pop_back();
+		if (i < scenario.capacity && particleContainer[i].expiryTick == 0)
+			return i;
+	}
+
+	for (int i = lastUsedParticle; i < scenario.capacity; i++)
 	{
-		if (particleContainer[i].life < 0)
+		if (particleContainer[i].expiryTick == 0)
 		{
 			lastUsedParticle = i;
 			return i;
 		}
 	}
 
-	for (int i = 0; i < lastUsedParticle; i++)
+	for (int i = 0; i < std::min(lastUsedParticle, scenario.capacity); i++)
 	{
-		if (particleContainer[i].life < 0)
+		if (particleContainer[i].expiryTick == 0)
 		{
 			lastUsedParticle = i;
 			return i;
@@ -483,7 +655,260 @@ int findUnusedParticle()
 	return -1; // All particles are taken, return -1
 }
 
+// One fixed tick of the simulation, then publish the alive particles in container order
+void stepSimulation(float dt, const SimInput& input, ParticleFrame& frame)
+{
+	simInput = input;
+	elapsedTime += dt;
+	simTick++;
+	lifetimes.advance(expired);
+	for (const TimingWheel::Entry& e : expired)
+	{ // Everything due this tick dies at once
+		Particle& p = particleContainer[e.slot];
+		if (p.id == e.id && p.expiryTick == e.tick)
+		{
+			p.expiryTick = 0;
+			p.cameraDist = -INFINITY;
+			freeSlots.push_back(e.slot);
+		}
+	}
+	spawnParticles(dt);
+	int numParticles = simulateParticles(dt);
+
+	if (!benchmark.enabled()) // a line per tick would be part of what's measured
+		std::cout << numParticles << std::endl;
+
+	frame.resize(numParticles, false);
+	int count = 0;
+	for (int i = 0; i < maxParticles && count < numParticles; i++)
+	{
+		Particle& p = particleContainer[i];
+		if (p.expiryTick != 0)
+		{ // For each currently alive particle
+			frame.slot[count] = i;
+			frame.id[count] = p.id;
+			frame.posSize[count] = glm::vec4(p.pos, p.size);
+			frame.color[count] = glm::vec4(p.r, p.g, p.b, p.a);
+			count++;
+		}
+	}
+	frame.count = count;
+	if (recorder.isOpen())
+		recorder.addFrame(elapsedTime, count, frame.id.data(), frame.posSize.data(), frame.color.data(), NULL);
+}
+
+// Spawns this frame's particles, the rate ramps up until the spawner shuts off at 100s
+void spawnParticles(float dt)
+{
+	// determine # of particles to spawn
+	float rate = scenario.particleRate*simInput.emission;
+	int toSpawn = (int)(dt*rate);
+	toSpawn *= elapsedTime / 10.0f;
+
+	float r = rng.uniform();
+	if (r < (dt*rate - (float)toSpawn))
+	{ // use non-integers to determine chance of spawning particle
+		toSpawn++;
+	}
+	// lives a whole number of ticks, at least one
+	uint32_t lifeTicks = (uint32_t)std::max(ceilf(particleLifetime / dt) - 1.0f, 1.0f);
+
+	// spawn new particles
+	if (elapsedTime < scenario.spawnUntil)
+	{
+		for (int i = 0; i < toSpawn; i++)
+		{
+			int index = findUnusedParticle();
+			if (index >= 0)
+			{
+				Particle& p = particleContainer[index];
+				p.id = nextParticleId++;
+
+				p.expiryTick = simTick + lifeTicks;
+				lifetimes.schedule(index, p.id, p.expiryTick);
+				float offX = spawnerDim[0] * rng.uniform();
+				float posX = spawnerPos[0] - (spawnerDim[0] / 2.0f) + offX;
+				float offY = spawnerDim[1] * rng.uniform();
+				float posY = spawnerPos[1] - (spawnerDim[1] / 2.0f) + offY;
+				float offZ = spawnerDim[2] * rng.uniform();
+				float posZ = spawnerPos[2] - (spawnerDim[2] / 2.0f) + offZ;
+				p.pos = glm::vec3(posX, posY, posZ);
+
+				float rTheta = rng.uniform() * 4.0f - 2.0f;
+				float rPhi = rng.uniform() * 4.0f - 2.0f;
+				float rMag = rng.uniform() * 2.0f;
+
+				glm::mat4 rot = glm::mat4(1.0f);
+				rot = glm::rotate(rot, glm::radians(rTheta), glm::vec3(0.0f, 1.0f, 0.0f));
+				rot = glm::rotate(rot, glm::radians(rPhi), glm::vec3(0.0f, 0.0f, 1.0f));
+
+				p.vel = glm::vec3(rot * glm::vec4(rMag * startVel, 1.0f));
+
+				p.r = rng.uniform();
+				p.g = rng.uniform();
+				p.b = rng.uniform();
+				p.a = rng.uniform();
+
+				p.size = (scenario.maxSize - scenario.minSize) * rng.uniform();
+
+				//p.cameraDist = glm::dot(p.pos, cameraFront);
+			}
+		}
+	}
+}
+
+// Moves every live particle on by dt, returns how many are alive
+int simulateParticles(float dt)
+{
+	int numParticles = 0; // number of particles actually existing right now
+	for (int i = 0; i < maxParticles; i++)
+	{
+		Particle& p = particleContainer[i];
+		if (p.expiryTick != 0)
+		{ // For each currently alive particle, the wheel takes care of dying
+			if (elapsedTime < 88.0)
+			{ //Spin and compress for 90 seconds
+				// Integrate acceleration and velocity using eularian integration
+				//p.vel += (-glm::normalize(p.pos) * 15.0f * dt / glm::length(p.pos));
+				//p.pos += p.vel * dt;
+
+				// Convert to polar
+				float r = sqrtf(p.pos[0] * p.pos[0] + p.pos[2] * p.pos[2]);
+				float theta = atan2f(p.pos[2], p.pos[0]);
+
+				float tMod = 5.0f / (r*r + 1) * elapsedTime / 20.0;
+				float rMod = 3.0f / (r + 1) * elapsedTime / 20.0;
+
+				theta += dt * tMod;
+				r += dt * -0.1f * exp(-0.1f * theta) * rMod;
+
+				// Convert back to cartesian
+				float x = r * cos(theta);
+				float z = r * sin(theta);
+
+				float yMod = 0.15 * elapsedTime / 15.0;
+
+				float y = p.pos[1] + (r - p.pos[1]) * dt * yMod;//y = p.pos[1] blended with z = r
+
+				p.pos = glm::vec3(x, y, z);
+
+				if (p.r < 1.0f)
+				{
+					p.r += dt / 88.0f;
+				}
+				if (p.g < 1.0f)
+				{
+					p.g += dt / 88.0f;
+				}
+				if (p.b < 0.4f)
+				{
+					p.b += dt / 88.0f;
+				}
+				else
+				{
+					p.b -= dt / 88.0f;
+				}
+			}
+			else
+			{
+				float life = (p.expiryTick - simTick) * dt; // Remaining life
+				if (life < elapsedTime*elapsedTime - 8070.0f)
+				{
+					p.pos += p.vel * dt;
+				}
+			}
+
+
+			p.cameraDist = glm::dot(p.pos, simInput.cameraFront);
+			numParticles++;
+		}
+	}
+	return numParticles;
+}
+
+// Reads a scenario file into scenario, default.scn lists every key
+bool parseScenario(const std::vector<ScenarioLine>& lines, Scenario& scenario)
+{
+	for (const ScenarioLine& line : lines)
+	{
+		const std::string& key = line.key();
+		float value;
+		bool ok = true;
+		if (key == "scene")
+		{
+			if (line.words.size() < 2 || line.words[1] != "galaxy")
+				return line.error("not a scenario for this scene");
+		}
+		else if (key == "capacity")
+		{
+			ok = line.numbers(1, &value, 1);
+			scenario.capacity = std::min(std::max((int)value, 1), maxParticles);
+			if (ok && (int)value > maxParticles)
+				std::cout << "Scenario line " << line.lineNumber << ": capacity limited to " << maxParticles << std::endl;
+		}
+		else if (key == "seed")
+		{
+			if (line.words.size() < 2)
+				return line.error("expected a seed");
+			scenario.seed = strtoull(line.words[1].c_str(), NULL, 10);
+		}
+		else if (key == "rate")
+		{
+			ok = line.numbers(1, &value, 1);
+			scenario.particleRate = (int)value;
+		}
+		else if (key == "size")
+		{
+			float size[2];
+			ok = line.numbers(1, size, 2);
+			scenario.minSize = size[0];
+			scenario.maxSize = size[1];
+		}
+		else if (key == "lifetime")
+			ok = line.numbers(1, &scenario.particleLifetime, 1);
+		else if (key == "spawnUntil")
+			ok = line.numbers(1, &scenario.spawnUntil, 1);
+		else if (key == "spawnerPos")
+			ok = line.numbers(1, &scenario.spawnerPos[0], 3);
+		else if (key == "spawnerDim")
+			ok = line.numbers(1, &scenario.spawnerDim[0], 3);
+		else if (key == "startVel")
+			ok = line.numbers(1, &scenario.startVel[0], 3);
+		else
+			return line.error("unknown key '" + key + "'");
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+// Copies the scenario's spawner settings and seed into the simulation
+void applyScenario()
+{
+	particleLifetime = scenario.particleLifetime;
+	spawnerPos = scenario.spawnerPos;
+	spawnerDim = scenario.spawnerDim;
+	startVel = scenario.startVel;
+	if (scenario.seed != 0)
+		rng.seed(scenario.seed);
+}
+
 void sortParticles() 
 {
 	std::sort(&particleContainer[0], &particleContainer[maxParticles]);
+	rebuildLifetimes(); // the wheel files particles by slot
+}
+
+// Files every live particle in the wheel again, after a snapshot restore or anything else
+// that replaces the particles under it
+void rebuildLifetimes()
+{
+	lifetimes.reset(simTick);
+	freeSlots.clear();
+	for (int i = 0; i < maxParticles; i++)
+	{
+		const Particle& p = particleContainer[i];
+		if (p.expiryTick != 0)
+			lifetimes.schedule(i, p.id, p.expiryTick);
+	}
 }
\ No newline at end of file
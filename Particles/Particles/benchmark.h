@@ -0,0 +1,334 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+/// benchmark.h
+/// frame timing, and its statistics for uncapped benchmark runs. Every frame's wall time, CPU
+/// time and GPU time (a GL_TIME_ELAPSED query around its commands) go into histograms bucketed
+/// like HdrHistogram, under 1% error from a microsecond to hours, and the run ends with p50,
+/// p90, p99 and max of each. Averages hide the odd long frame; the tail percentiles don't.
+
+#include <glad/glad.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+// counts of microsecond values, exact below 128 and then 128 linear buckets per power of two
+class TimeHistogram
+{
+public:
+	TimeHistogram() : buckets((maxMagnitude - subBits + 2) << subBits, 0) {}
+
+	void record(double seconds)
+	{
+		uint64_t us = seconds <= 0.0 ? 0 : (uint64_t)(seconds * 1e6 + 0.5);
+		buckets[bucketOf(us)]++;
+		total++;
+		largest = us > largest ? us : largest;
+	}
+	uint64_t count() const
+	{
+		return total;
+	}
+	// seconds at or below which p percent of the values fall, to within the bucket's width
+	// ------------------------------------------------------------------------
+	double percentile(double p) const
+	{
+		if (total == 0)
+			return 0.0;
+		uint64_t target = (uint64_t)(p / 100.0 * (double)total + 0.999999);
+		target = target < 1 ? 1 : target;
+		uint64_t seen = 0;
+		for (size_t i = 0; i < buckets.size(); i++)
+		{
+			seen += buckets[i];
+			if (seen >= target)
+			{ // the bucket's highest value, but never beyond the largest actually seen
+				uint64_t top = bucketTop((int)i);
+				return (double)(top < largest ? top : largest) * 1e-6;
+			}
+		}
+		return max();
+	}
+	double max() const
+	{
+		return (double)largest * 1e-6;
+	}
+
+private:
+	static const int subBits = 7;
+	static const int maxMagnitude = 40; // 2^41 us, about 25 days
+	std::vector<uint64_t> buckets;
+	uint64_t total = 0, largest = 0;
+
+	static int bucketOf(uint64_t us)
+	{
+		if (us < (1u << subBits))
+			return (int)us;
+		int magnitude = 0;
+		while ((us >> magnitude) > 1)
+			magnitude++;
+		if (magnitude > maxMagnitude)
+			return bucketOf((2ull << maxMagnitude) - 1);
+		int sub = (int)((us >> (magnitude - subBits)) & ((1u << subBits) - 1));
+		return ((magnitude - subBits + 1) << subBits) + sub;
+	}
+	static uint64_t bucketTop(int index)
+	{
+		if (index < (1 << subBits))
+			return (uint64_t)index;
+		int magnitude = (index >> subBits) + subBits - 1;
+		uint64_t top = (uint64_t)((1 << subBits) + (index & ((1 << subBits) - 1)) + 1);
+		return (top << (magnitude - subBits)) - 1;
+	}
+};
+
+// how long each frame took: from one beginFrame to the next, the CPU's share up to endFrame,
+// and the GPU's from a GL_TIME_ELAPSED query around the same commands. The queries are kept in
+// a ring deep enough that a result is only read once it is there, so GPU times arrive a few
+// frames late and measuring never stalls the pipeline.
+class FrameTimer
+{
+public:
+	FrameTimer() {}
+	FrameTimer(const FrameTimer&) = delete;
+	FrameTimer& operator=(const FrameTimer&) = delete;
+
+	// once there is a context. Until then every call does nothing.
+	// ------------------------------------------------------------------------
+	void start()
+	{
+		if (on)
+			return;
+		queries.resize(queryDepth);
+		glGenQueries(queryDepth, queries.data());
+		on = true;
+	}
+	bool started() const
+	{
+		return on;
+	}
+	// at the top of the frame, before any of its work
+	// ------------------------------------------------------------------------
+	void beginFrame()
+	{
+		if (!on)
+			return;
+		frameStart = Clock::now();
+		gpu.clear();
+		if (pending == queryDepth)
+			collect(true); // every query still in flight, the oldest has to be waited for
+		glBeginQuery(GL_TIME_ELAPSED, queries[(next + pending) % queryDepth]);
+		inFrame = true;
+	}
+	// a frame given up part way, nothing from it is measured
+	// ------------------------------------------------------------------------
+	void discardFrame()
+	{
+		if (!on || !inFrame)
+			return;
+		glEndQuery(GL_TIME_ELAPSED); // its query is reused by the next frame unread
+		inFrame = false;
+	}
+	// after the frame's last command, before the swap. False for a frame that was discarded.
+	// ------------------------------------------------------------------------
+	bool endFrame()
+	{
+		if (!on || !inFrame)
+			return false;
+		glEndQuery(GL_TIME_ELAPSED);
+		inFrame = false;
+		cpu = seconds(frameStart, Clock::now());
+		interval = measured > 0 ? seconds(lastFrameStart, frameStart) : 0.0;
+		lastFrameStart = frameStart;
+		measured++;
+		pending++;
+		collect(false);
+		return true;
+	}
+	// waits for every GPU time still out, into gpuSeconds, and lets the queries go. Needs the
+	// context still there.
+	// ------------------------------------------------------------------------
+	void finish()
+	{
+		if (!on)
+			return;
+		gpu.clear();
+		while (pending > 0)
+			collect(true);
+		glDeleteQueries((GLsizei)queries.size(), queries.data());
+		queries.clear();
+		on = false;
+	}
+
+	// the last measured frame's CPU time, and the time since the one before (0 for the first)
+	double cpuSeconds() const
+	{
+		return cpu;
+	}
+	double intervalSeconds() const
+	{
+		return interval;
+	}
+	// GPU times that came back during this frame, oldest first, usually one
+	const std::vector<double>& gpuSeconds() const
+	{
+		return gpu;
+	}
+	// the newest GPU time there is, 0 before the first
+	double latestGpuSeconds() const
+	{
+		return latestGpu;
+	}
+	long framesMeasured() const
+	{
+		return measured;
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+	static const int queryDepth = 4;
+
+	bool on = false;
+	bool inFrame = false;
+	Clock::time_point frameStart, lastFrameStart;
+	double cpu = 0.0, interval = 0.0, latestGpu = 0.0;
+	std::vector<double> gpu;
+	long measured = 0;
+	std::vector<GLuint> queries;
+	int next = 0, pending = 0; // oldest query in flight and how many are
+
+	static double seconds(Clock::time_point from, Clock::time_point to)
+	{
+		return std::chrono::duration<double>(to - from).count();
+	}
+	// reads finished queries oldest first, waiting for the oldest if wait
+	void collect(bool wait)
+	{
+		while (pending > 0)
+		{
+			GLuint query = queries[next];
+			if (!wait)
+			{
+				GLint available = 0;
+				glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available)
+					return;
+			}
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+			latestGpu = (double)ns * 1e-9;
+			gpu.push_back(latestGpu);
+			next = (next + 1) % queryDepth;
+			pending--;
+			wait = false;
+		}
+	}
+};
+
+// a --benchmark run: how long it goes on for, and the histograms of what a FrameTimer measured
+class Benchmark
+{
+public:
+	Benchmark() {}
+	Benchmark(const Benchmark&) = delete;
+	Benchmark& operator=(const Benchmark&) = delete;
+
+	// length is a frame count ("600") or seconds ("30s"), false if it's neither
+	// ------------------------------------------------------------------------
+	bool init(const char* length)
+	{
+		char* end;
+		double n = strtod(length, &end);
+		if (end == length || n <= 0.0 || (*end != '\0' && strcmp(end, "s") != 0))
+		{
+			std::cout << "Benchmark length '" << length << "' should be frames (600) or seconds (30s)" << std::endl;
+			return false;
+		}
+		if (*end == 's')
+			runSeconds = n;
+		else
+			runFrames = (long)n;
+		on = true;
+		return true;
+	}
+	bool enabled() const
+	{
+		return on;
+	}
+	// the run's clock starts here
+	// ------------------------------------------------------------------------
+	void start()
+	{
+		startTime = Clock::now();
+	}
+	// adds the frame timer has just measured, after its endFrame (or finish)
+	// ------------------------------------------------------------------------
+	void record(const FrameTimer& timer, bool measured)
+	{
+		if (!on)
+			return;
+		if (measured)
+		{
+			cpu.record(timer.cpuSeconds());
+			if (timer.intervalSeconds() > 0.0)
+				frame.record(timer.intervalSeconds());
+			frames++;
+		}
+		for (double s : timer.gpuSeconds())
+			gpu.record(s);
+	}
+	bool finished() const
+	{
+		if (!on)
+			return false;
+		if (runFrames > 0)
+			return frames >= runFrames;
+		return seconds(startTime, Clock::now()) >= runSeconds;
+	}
+	// prints the percentiles, once the timer has finished so every GPU time is in
+	// ------------------------------------------------------------------------
+	void report() const
+	{
+		if (!on)
+			return;
+		double elapsed = seconds(startTime, Clock::now());
+		std::cout << "Benchmark: " << frames << " frames in " << std::fixed << std::setprecision(2) << elapsed << " s ("
+			<< (elapsed > 0.0 ? frames / elapsed : 0.0) << " fps)" << std::endl;
+		std::cout << "  ms        p50      p90      p99      max" << std::endl;
+		row("frame", frame);
+		row("cpu", cpu);
+		row("gpu", gpu);
+		std::cout.unsetf(std::ios::floatfield);
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	bool on = false;
+	long runFrames = 0; // run length, one of these two
+	double runSeconds = 0.0;
+	Clock::time_point startTime;
+	long frames = 0;
+	TimeHistogram frame, cpu, gpu;
+
+	static double seconds(Clock::time_point from, Clock::time_point to)
+	{
+		return std::chrono::duration<double>(to - from).count();
+	}
+	static void row(const char* name, const TimeHistogram& h)
+	{
+		std::cout << "  " << std::left << std::setw(6) << name << std::right;
+		const double percentiles[3] = { 50.0, 90.0, 99.0 };
+		for (double p : percentiles)
+			std::cout << std::setw(9) << h.percentile(p) * 1e3;
+		std::cout << std::setw(9) << h.max() * 1e3 << std::endl;
+	}
+};
+#endif
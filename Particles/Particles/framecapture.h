@@ -0,0 +1,201 @@
+#ifndef FRAMECAPTURE_H
+#define FRAMECAPTURE_H
+
+/// framecapture.h
+/// offscreen render target for batch renders. Frames are drawn into an FBO, read back
+/// through a ring of pixel buffer objects so glReadPixels returns without waiting for the
+/// gpu, and written out as a numbered PNG sequence on the thread pool.
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "threadpool.h"
+
+#include <stb/stb_image_write.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+// hidden window whose only use is its context. Build servers without a display or gpu
+// often can't give a native context, so fall back to the context apis glfw can create
+// without one (EGL surfaceless, or OSMesa when glfw was built with it).
+inline GLFWwindow* createOffscreenWindow(int width, int height, const char* title)
+{
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow* window = glfwCreateWindow(width, height, title, NULL, NULL);
+	if (!window)
+	{
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+		window = glfwCreateWindow(width, height, title, NULL, NULL);
+	}
+#ifdef GLFW_OSMESA_CONTEXT_API
+	if (!window)
+	{
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+		window = glfwCreateWindow(width, height, title, NULL, NULL);
+	}
+#endif
+	if (!window)
+		std::cout << "Failed to create an offscreen context" << std::endl;
+	return window;
+}
+
+class FrameCapture
+{
+public:
+	explicit FrameCapture(ThreadPool& pool) : pool(pool) {}
+	~FrameCapture()
+	{
+		finish();
+	}
+	FrameCapture(const FrameCapture&) = delete;
+	FrameCapture& operator=(const FrameCapture&) = delete;
+
+	// pattern is a printf format taking the frame number, e.g. "frames/frame_%05d.png".
+	// ringSize is how many frames can be in flight on the gpu before a readback waits.
+	// ------------------------------------------------------------------------
+	bool init(int width, int height, const std::string& pattern, int ringSize = 3)
+	{
+		this->width = width;
+		this->height = height;
+		this->pattern = pattern;
+
+		glGenFramebuffers(1, &FBO);
+		glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+		glGenRenderbuffers(2, renderbuffers);
+		glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+		glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+		bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (!complete)
+		{
+			std::cout << "Offscreen framebuffer is incomplete" << std::endl;
+			return false;
+		}
+
+		slots.resize(ringSize);
+		for (Slot& slot : slots)
+		{
+			glGenBuffers(1, &slot.PBO);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.PBO);
+			glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4, NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		// gl rows run bottom to top
+		stbi_flip_vertically_on_write(1);
+		return true;
+	}
+	// draw the next frame into the offscreen target
+	void bind() const
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+		glViewport(0, 0, width, height);
+	}
+	// queue a readback of what was drawn since bind(). The pixels are collected a few
+	// frames later, once the gpu has finished with them.
+	// ------------------------------------------------------------------------
+	void capture()
+	{
+		Slot& slot = slots[next];
+		if (slot.fence)
+			collect(slot); // ring is full, this is the oldest frame in flight
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, FBO);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.PBO);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.frame = frameNumber++;
+		next = (next + 1) % (int)slots.size();
+	}
+	// collect every frame still in flight and wait for the encoders
+	// ------------------------------------------------------------------------
+	void finish()
+	{
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			Slot& slot = slots[(next + i) % slots.size()];
+			if (slot.fence)
+				collect(slot);
+		}
+		while (!encodes.empty())
+			waitOldestEncode();
+	}
+	int framesCaptured() const
+	{
+		return frameNumber;
+	}
+
+private:
+	struct Slot
+	{
+		unsigned int PBO = 0;
+		GLsync fence = 0;
+		int frame = 0;
+	};
+
+	ThreadPool& pool;
+	int width = 0, height = 0;
+	std::string pattern;
+	unsigned int FBO = 0;
+	unsigned int renderbuffers[2] = { 0, 0 };
+	std::vector<Slot> slots;
+	int next = 0, frameNumber = 0;
+	std::deque<std::future<bool>> encodes;
+
+	// copy a finished readback out of its PBO and hand it to a worker to encode
+	void collect(Slot& slot)
+	{
+		glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+
+		std::vector<unsigned char> pixels((size_t)width * height * 4);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.PBO);
+		void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)pixels.size(), GL_MAP_READ_BIT);
+		if (mapped)
+		{
+			memcpy(pixels.data(), mapped, pixels.size());
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		if (!mapped)
+		{
+			std::cout << "Failed to read back frame " << slot.frame << std::endl;
+			return;
+		}
+
+		// don't let encoding fall arbitrarily far behind, each queued frame holds a full image
+		while (encodes.size() >= 2 * pool.size())
+			waitOldestEncode();
+
+		char path[512];
+		snprintf(path, sizeof(path), pattern.c_str(), slot.frame);
+		std::string file = path;
+		int w = width, h = height;
+		encodes.push_back(pool.submit([file, w, h, pixels = std::move(pixels)]() mutable {
+			// drop alpha in place, what was blended into it isn't meant to be seen
+			for (size_t i = 0; i < (size_t)w * h; i++)
+				memmove(&pixels[i * 3], &pixels[i * 4], 3);
+			bool written = stbi_write_png(file.c_str(), w, h, 3, pixels.data(), w * 3) != 0;
+			if (!written)
+				std::cout << "Failed to write " << file << std::endl;
+			return written;
+		}));
+	}
+	void waitOldestEncode()
+	{
+		encodes.front().get();
+		encodes.pop_front();
+	}
+};
+#endif
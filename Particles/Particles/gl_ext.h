@@ -0,0 +1,148 @@
+#ifndef GL_EXT_H
+#define GL_EXT_H
+
+/// gl_ext.h
+/// optional extension entry points. glad.c was generated for gl 3.3 core with no
+/// extensions, so anything newer is looked up here and only used when present.
+
+#include <glad/glad.h>
+
+#include <cstring>
+
+// KHR_parallel_shader_compile
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+// ARB_get_program_binary (core in 4.1)
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#define GL_PROGRAM_BINARY_FORMATS 0x87FF
+#endif
+typedef void (APIENTRYP PFNGLGETPROGRAMBINARYPROC)(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+typedef void (APIENTRYP PFNGLPROGRAMBINARYPROC)(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+typedef void (APIENTRYP PFNGLPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+
+// compute shaders, storage buffers, atomic counters and indirect draws (core in 4.3)
+#ifndef GL_COMPUTE_SHADER
+#define GL_COMPUTE_SHADER 0x91B9
+#endif
+#ifndef GL_SHADER_STORAGE_BUFFER
+#define GL_SHADER_STORAGE_BUFFER 0x90D2
+#endif
+#ifndef GL_ATOMIC_COUNTER_BUFFER
+#define GL_ATOMIC_COUNTER_BUFFER 0x92C0
+#endif
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+#ifndef GL_COMMAND_BARRIER_BIT
+#define GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT 0x00000001
+#define GL_COMMAND_BARRIER_BIT 0x00000040
+#define GL_ATOMIC_COUNTER_BARRIER_BIT 0x00001000
+#define GL_SHADER_STORAGE_BARRIER_BIT 0x00002000
+#endif
+typedef void (APIENTRYP PFNGLDISPATCHCOMPUTEPROC)(GLuint numGroupsX, GLuint numGroupsY, GLuint numGroupsZ);
+typedef void (APIENTRYP PFNGLMEMORYBARRIERPROC)(GLbitfield barriers);
+typedef void (APIENTRYP PFNGLDRAWARRAYSINDIRECTPROC)(GLenum mode, const void *indirect);
+
+// ARB_pipeline_statistics_query (core in 4.6), only new query targets for glBeginQuery
+#ifndef GL_FRAGMENT_SHADER_INVOCATIONS_ARB
+#define GL_FRAGMENT_SHADER_INVOCATIONS_ARB 0x82F4
+#endif
+
+// same layout as the command glDrawArraysIndirect reads
+struct DrawArraysIndirectCommand
+{
+	GLuint count;
+	GLuint instanceCount;
+	GLuint first;
+	GLuint baseInstance;
+};
+
+struct GLExtensions
+{
+	bool parallelShaderCompile = false;
+	PFNGLMAXSHADERCOMPILERTHREADSKHRPROC MaxShaderCompilerThreadsKHR = nullptr;
+
+	bool programBinary = false;
+	PFNGLGETPROGRAMBINARYPROC GetProgramBinary = nullptr;
+	PFNGLPROGRAMBINARYPROC ProgramBinary = nullptr;
+	PFNGLPROGRAMPARAMETERIPROC ProgramParameteri = nullptr;
+
+	bool computeDraw = false;
+	PFNGLDISPATCHCOMPUTEPROC DispatchCompute = nullptr;
+	PFNGLMEMORYBARRIERPROC MemoryBarrierGL = nullptr; // plain MemoryBarrier is a macro in windows.h
+	PFNGLDRAWARRAYSINDIRECTPROC DrawArraysIndirect = nullptr;
+
+	bool pipelineStatistics = false;
+};
+
+// extension state for the current context, filled in by loadGLExtensions
+inline GLExtensions& glExt()
+{
+	static GLExtensions ext;
+	return ext;
+}
+
+inline bool hasGLExtension(const char* name)
+{
+	GLint numExtensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+	for (GLint i = 0; i < numExtensions; i++)
+	{
+		const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+		if (ext && strcmp(ext, name) == 0)
+			return true;
+	}
+	return false;
+}
+
+inline bool hasGLVersion(int major, int minor)
+{
+	GLint ctxMajor = 0, ctxMinor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &ctxMajor);
+	glGetIntegerv(GL_MINOR_VERSION, &ctxMinor);
+	return ctxMajor > major || (ctxMajor == major && ctxMinor >= minor);
+}
+
+// call once after gladLoadGLLoader with the same loader
+inline void loadGLExtensions(GLADloadproc load)
+{
+	GLExtensions& ext = glExt();
+
+	if (hasGLExtension("GL_KHR_parallel_shader_compile") || hasGLExtension("GL_ARB_parallel_shader_compile"))
+	{
+		ext.MaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)load("glMaxShaderCompilerThreadsKHR");
+		if (!ext.MaxShaderCompilerThreadsKHR)
+			ext.MaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)load("glMaxShaderCompilerThreadsARB");
+		ext.parallelShaderCompile = ext.MaxShaderCompilerThreadsKHR != nullptr;
+	}
+
+	if (hasGLVersion(4, 1) || hasGLExtension("GL_ARB_get_program_binary"))
+	{
+		ext.GetProgramBinary = (PFNGLGETPROGRAMBINARYPROC)load("glGetProgramBinary");
+		ext.ProgramBinary = (PFNGLPROGRAMBINARYPROC)load("glProgramBinary");
+		ext.ProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)load("glProgramParameteri");
+		// drivers may expose the entry points but support no binary formats at all
+		GLint numFormats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+		ext.programBinary = ext.GetProgramBinary && ext.ProgramBinary && ext.ProgramParameteri && numFormats > 0;
+	}
+
+	if (hasGLVersion(4, 3) || (hasGLExtension("GL_ARB_compute_shader") && hasGLExtension("GL_ARB_shader_storage_buffer_object")
+		&& hasGLExtension("GL_ARB_shader_atomic_counters") && hasGLExtension("GL_ARB_draw_indirect")))
+	{
+		ext.DispatchCompute = (PFNGLDISPATCHCOMPUTEPROC)load("glDispatchCompute");
+		ext.MemoryBarrierGL = (PFNGLMEMORYBARRIERPROC)load("glMemoryBarrier");
+		ext.DrawArraysIndirect = (PFNGLDRAWARRAYSINDIRECTPROC)load("glDrawArraysIndirect");
+		ext.computeDraw = ext.DispatchCompute && ext.MemoryBarrierGL && ext.DrawArraysIndirect;
+	}
+
+	ext.pipelineStatistics = hasGLVersion(4, 6) || hasGLExtension("GL_ARB_pipeline_statistics_query");
+}
+#endif
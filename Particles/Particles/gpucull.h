@@ -0,0 +1,128 @@
+#ifndef GPUCULL_H
+#define GPUCULL_H
+
+/// gpucull.h
+/// frustum culling of instanced particles on the gpu. A compute pass reads the instance
+/// buffers, appends the visible instances to buffers of its own and counts them with an
+/// atomic counter that sits inside a DrawArraysIndirectCommand, so the draw takes its
+/// instance count from the gpu and nothing is read back.
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "gl_ext.h"
+#include "shader.h"
+
+#include <memory>
+#include <iostream>
+
+class InstanceCuller
+{
+public:
+	// builds the compute program, the compacted instance buffers and a VAO that draws them
+	// with the quad from quadBuffer at location 0. False if the context can't run it, in
+	// which case keep drawing the way it was done before.
+	// ------------------------------------------------------------------------
+	bool init(const char* computePath, int maxInstances, unsigned int quadBuffer)
+	{
+		if (!glExt().computeDraw)
+			return false;
+		program.reset(new Shader(computePath));
+		if (!program->isLinked())
+		{
+			std::cout << "Culling shader failed, drawing every particle" << std::endl;
+			return false;
+		}
+		planesLocation = glGetUniformLocation(program->ID, "planes");
+		countLocation = glGetUniformLocation(program->ID, "numInstances");
+
+		glGenBuffers(2, visibleBuffers);
+		for (int i = 0; i < 2; i++)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, visibleBuffers[i]);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4) * maxInstances, NULL, GL_DYNAMIC_COPY);
+		}
+		glGenBuffers(1, &commandBuffer);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawArraysIndirectCommand), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+		// same layout as the particle VAO, only the instance data comes from the visible list
+		glGenVertexArrays(1, &VAO);
+		glBindVertexArray(VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+		glEnableVertexAttribArray(0);
+		for (int i = 0; i < 2; i++)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, visibleBuffers[i]);
+			glVertexAttribPointer(1 + i, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+			glEnableVertexAttribArray(1 + i);
+			glVertexAttribDivisor(1 + i, 1);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
+		return true;
+	}
+	// culls the first count instances of positionBuffer (xyz and size) and colorBuffer.
+	// Leaves the culling program in use.
+	// ------------------------------------------------------------------------
+	void cull(unsigned int positionBuffer, unsigned int colorBuffer, int count, const glm::mat4& viewProjection)
+	{
+		// the counter increments instanceCount, so every frame starts from an empty draw
+		DrawArraysIndirectCommand command = { 4, 0, 0, 0 };
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(command), &command);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		if (count <= 0)
+			return;
+
+		glm::vec4 planes[6];
+		frustumPlanes(viewProjection, planes);
+		program->use();
+		glUniform4fv(planesLocation, 6, &planes[0][0]);
+		glUniform1ui(countLocation, (GLuint)count);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, positionBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, colorBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, visibleBuffers[0]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, visibleBuffers[1]);
+		glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, commandBuffer);
+		glExt().DispatchCompute((GLuint)(count + groupSize - 1) / groupSize, 1, 1);
+		// the draw reads the command and the instances written above
+		glExt().MemoryBarrierGL(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	}
+	// draws whatever survived the last cull with the program currently in use
+	// ------------------------------------------------------------------------
+	void draw() const
+	{
+		glBindVertexArray(VAO);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+		glExt().DrawArraysIndirect(GL_TRIANGLE_STRIP, (void*)0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+
+private:
+	static const int groupSize = 256; // local_size_x in the compute shader
+
+	std::unique_ptr<Shader> program;
+	GLint planesLocation = -1, countLocation = -1;
+	unsigned int visibleBuffers[2] = { 0, 0 }; // position and size, color
+	unsigned int commandBuffer = 0;
+	unsigned int VAO = 0;
+
+	// the six planes of the view frustum, pointing inwards with unit length normals
+	static void frustumPlanes(const glm::mat4& m, glm::vec4* planes)
+	{
+		glm::vec4 rows[4];
+		for (int i = 0; i < 4; i++)
+			rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+		for (int i = 0; i < 3; i++)
+		{
+			planes[2 * i] = rows[3] + rows[i];
+			planes[2 * i + 1] = rows[3] - rows[i];
+		}
+		for (int i = 0; i < 6; i++)
+			planes[i] /= glm::length(glm::vec3(planes[i]));
+	}
+};
+#endif
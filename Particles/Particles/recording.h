@@ -0,0 +1,500 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+
+/// recording.h
+/// records the per-frame particle instance data to disk and plays it back without running
+/// the simulation. Positions and sizes are stored as 1/1024 fixed point and colors as 8 bit.
+/// Each frame lists its particles' ids, and every value is delta-encoded against the particle
+/// with the same id in the previous frame (against zero for one born since), so deaths and
+/// reordering don't break the deltas. Deltas are written as zigzag varints with runs of
+/// unchanged values collapsed. Every keyframeInterval frames is encoded against zero so
+/// playback can seek. Encoding and writing happen on a background
+/// thread; playback maps the file and decodes straight into the renderer's arrays.
+
+#include <glm/glm.hpp>
+
+#include "mappedfile.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <iostream>
+
+namespace Recording
+{
+	const uint32_t MAGIC = 0x43455250; // "PREC"
+	const uint32_t VERSION = 2;
+	const int CHANNELS = 9; // x, y, z, size, r, g, b, a, sprite
+	const float POSITION_SCALE = 1024.0f;
+
+	struct FileHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t frameCount;
+		uint32_t keyframeInterval;
+		uint32_t maxParticles;
+		uint32_t reserved;
+		uint64_t indexOffset; // uint64 offset of every frame, written on close
+	};
+	struct FrameHeader
+	{
+		float time; // seconds since the first recorded frame
+		uint32_t count;
+		uint32_t keyframe;
+		uint32_t payloadSize;
+	};
+
+	inline void quantize(int count, const glm::vec4* posSize, const glm::vec4* color, const float* sprite, std::vector<int32_t>& q)
+	{
+		q.resize((size_t)count * CHANNELS);
+		for (int i = 0; i < count; i++)
+		{
+			int32_t* v = &q[(size_t)i * CHANNELS];
+			for (int k = 0; k < 4; k++)
+				v[k] = (int32_t)lroundf(posSize[i][k] * POSITION_SCALE);
+			for (int k = 0; k < 4; k++)
+				v[4 + k] = (int32_t)lroundf(std::min(std::max(color[i][k], 0.0f), 1.0f) * 255.0f);
+			v[8] = sprite ? (int32_t)sprite[i] : 0;
+		}
+	}
+
+	inline void putVarint(std::vector<unsigned char>& out, uint32_t value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back((unsigned char)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((unsigned char)value);
+	}
+	inline uint32_t getVarint(const unsigned char*& in)
+	{
+		uint32_t value = 0;
+		int shift = 0;
+		while (*in & 0x80)
+		{
+			value |= (uint32_t)(*in++ & 0x7F) << shift;
+			shift += 7;
+		}
+		value |= (uint32_t)(*in++) << shift;
+		return value;
+	}
+
+	// where each id sits in a frame, to find a particle's values in the one before
+	typedef std::unordered_map<uint32_t, int> IdIndex;
+	inline void indexIds(const std::vector<uint32_t>& ids, int count, IdIndex& index)
+	{
+		index.clear();
+		for (int i = 0; i < count; i++)
+			index[ids[i]] = i;
+	}
+	// each particle's values in the previous frame, found by id. Zero for a particle that
+	// wasn't in it, or for everything when there is no previous frame (prevIndex NULL).
+	inline void matchPrevious(const std::vector<uint32_t>& ids, int count, const std::vector<int32_t>& prev, const IdIndex* prevIndex, std::vector<int32_t>& base)
+	{
+		base.assign((size_t)count * CHANNELS, 0);
+		if (!prevIndex)
+			return;
+		for (int i = 0; i < count; i++)
+		{
+			IdIndex::const_iterator found = prevIndex->find(ids[i]);
+			if (found != prevIndex->end())
+				memcpy(&base[(size_t)i * CHANNELS], &prev[(size_t)found->second * CHANNELS], CHANNELS * sizeof(int32_t));
+		}
+	}
+
+	// ids go first, each as a zigzag delta from the one before it in the frame. Then the value
+	// deltas from base, channel by channel. A zero delta only ever encodes as a single 0 byte,
+	// so a 0 byte is followed by how many zeros in a row it stands for.
+	inline void encode(const std::vector<int32_t>& q, const std::vector<uint32_t>& ids, int count, const std::vector<int32_t>& base, std::vector<unsigned char>& out)
+	{
+		out.clear();
+		uint32_t lastId = 0;
+		for (int i = 0; i < count; i++)
+		{
+			int32_t delta = (int32_t)(ids[i] - lastId);
+			putVarint(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+			lastId = ids[i];
+		}
+		uint32_t zeroRun = 0;
+		for (int k = 0; k < CHANNELS; k++)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				int32_t delta = q[(size_t)i * CHANNELS + k] - base[(size_t)i * CHANNELS + k];
+				if (delta == 0)
+				{
+					zeroRun++;
+					continue;
+				}
+				if (zeroRun > 0)
+				{
+					out.push_back(0);
+					putVarint(out, zeroRun);
+					zeroRun = 0;
+				}
+				putVarint(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31)); // zigzag
+			}
+		}
+		if (zeroRun > 0)
+		{
+			out.push_back(0);
+			putVarint(out, zeroRun);
+		}
+	}
+	// reads a frame's ids, returns where its values start
+	inline const unsigned char* decodeIds(const unsigned char* in, int count, std::vector<uint32_t>& ids)
+	{
+		ids.resize(count);
+		uint32_t lastId = 0;
+		for (int i = 0; i < count; i++)
+		{
+			uint32_t zigzag = getVarint(in);
+			lastId += (uint32_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+			ids[i] = lastId;
+		}
+		return in;
+	}
+	// q holds the frame's base (from matchPrevious) on entry and its values on return
+	inline void decodeValues(const unsigned char* in, int count, std::vector<int32_t>& q)
+	{
+		uint32_t zeroRun = 0;
+		for (int k = 0; k < CHANNELS; k++)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				if (zeroRun == 0 && *in == 0)
+				{
+					in++;
+					zeroRun = getVarint(in);
+				}
+				if (zeroRun > 0)
+				{
+					zeroRun--;
+					continue;
+				}
+				uint32_t zigzag = getVarint(in);
+				q[(size_t)i * CHANNELS + k] += (int32_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+			}
+		}
+	}
+}
+
+class FrameRecorder
+{
+public:
+	~FrameRecorder()
+	{
+		close();
+	}
+
+	bool open(const char* path, int maxParticles, int keyframeInterval = 60)
+	{
+		file = fopen(path, "wb");
+		if (!file)
+		{
+			std::cout << "Failed to open recording " << path << std::endl;
+			return false;
+		}
+		header.magic = Recording::MAGIC;
+		header.version = Recording::VERSION;
+		header.frameCount = 0;
+		header.keyframeInterval = (uint32_t)keyframeInterval;
+		header.maxParticles = (uint32_t)maxParticles;
+		header.reserved = 0;
+		header.indexOffset = 0;
+		bytesWritten = 0;
+		writeFailed = false;
+		write(&header, sizeof(header));
+		stopping = false;
+		writer = std::thread([this] { writerLoop(); });
+		return true;
+	}
+	bool isOpen() const
+	{
+		return file != NULL;
+	}
+	// copies the frame and returns straight away. If the writer is too far behind the
+	// frame is dropped rather than stalling the simulation.
+	void addFrame(float time, int count, const unsigned int* id, const glm::vec4* posSize, const glm::vec4* color, const float* sprite)
+	{
+		if (!file)
+			return;
+		std::unique_lock<std::mutex> lock(queueMutex);
+		if (firstTime < 0.0f)
+			firstTime = time;
+		if (queue.size() >= maxQueued)
+		{
+			dropped++;
+			return;
+		}
+		RawFrame frame;
+		if (!spare.empty())
+		{
+			frame = std::move(spare.back());
+			spare.pop_back();
+		}
+		lock.unlock();
+
+		frame.time = time - firstTime;
+		frame.count = count;
+		frame.id.assign(id, id + count);
+		frame.posSize.assign(posSize, posSize + count);
+		frame.color.assign(color, color + count);
+		if (sprite)
+			frame.sprite.assign(sprite, sprite + count);
+		else
+			frame.sprite.clear();
+
+		lock.lock();
+		queue.push_back(std::move(frame));
+		lock.unlock();
+		queueCondition.notify_one();
+	}
+	// writes out everything queued, then the frame index
+	void close()
+	{
+		if (!file)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			stopping = true;
+		}
+		queueCondition.notify_one();
+		writer.join();
+
+		header.indexOffset = bytesWritten;
+		header.frameCount = (uint32_t)frameOffsets.size();
+		if (!frameOffsets.empty())
+			write(frameOffsets.data(), frameOffsets.size() * sizeof(uint64_t));
+		fseek(file, 0, SEEK_SET); // only ever back to the start, fine with a 32 bit long
+		write(&header, sizeof(header));
+		if (fclose(file) != 0)
+			writeFailed = true;
+		file = NULL;
+		if (writeFailed)
+			std::cout << "Recording failed to write, the file is incomplete" << std::endl;
+		if (dropped > 0)
+			std::cout << "Recording dropped " << dropped << " frames, the writer couldn't keep up" << std::endl;
+	}
+
+private:
+	struct RawFrame
+	{
+		float time = 0.0f;
+		int count = 0;
+		std::vector<uint32_t> id;
+		std::vector<glm::vec4> posSize, color;
+		std::vector<float> sprite;
+	};
+
+	FILE* file = NULL;
+	Recording::FileHeader header;
+	// counted here rather than asked of ftell, whose long is 32 bits on Windows and gives out at 2 GB
+	uint64_t bytesWritten = 0;
+	bool writeFailed = false;
+	std::vector<uint64_t> frameOffsets;
+	float firstTime = -1.0f;
+	int dropped = 0;
+
+	std::thread writer;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	std::deque<RawFrame> queue;
+	std::vector<RawFrame> spare; // buffers handed back by the writer for reuse
+	const size_t maxQueued = 8;
+	bool stopping = false;
+
+	void write(const void* data, size_t size)
+	{
+		if (fwrite(data, 1, size, file) != size)
+			writeFailed = true;
+		bytesWritten += size;
+	}
+
+	void writerLoop()
+	{
+		std::vector<int32_t> current, previous, base;
+		Recording::IdIndex previousIndex;
+		std::vector<unsigned char> payload;
+		while (true)
+		{
+			RawFrame frame;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueCondition.wait(lock, [this] { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+				frame = std::move(queue.front());
+				queue.pop_front();
+			}
+
+			bool keyframe = frameOffsets.size() % header.keyframeInterval == 0;
+			Recording::quantize(frame.count, frame.posSize.data(), frame.color.data(), frame.sprite.empty() ? NULL : frame.sprite.data(), current);
+			Recording::matchPrevious(frame.id, frame.count, previous, keyframe ? NULL : &previousIndex, base);
+			Recording::encode(current, frame.id, frame.count, base, payload);
+
+			Recording::FrameHeader frameHeader;
+			frameHeader.time = frame.time;
+			frameHeader.count = (uint32_t)frame.count;
+			frameHeader.keyframe = keyframe ? 1 : 0;
+			frameHeader.payloadSize = (uint32_t)payload.size();
+			frameOffsets.push_back(bytesWritten);
+			write(&frameHeader, sizeof(frameHeader));
+			write(payload.data(), payload.size());
+
+			std::swap(current, previous);
+			Recording::indexIds(frame.id, frame.count, previousIndex);
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				spare.push_back(std::move(frame));
+			}
+		}
+	}
+};
+
+class FramePlayback
+{
+public:
+	bool open(const char* path)
+	{
+		if (!file.open(path))
+		{
+			std::cout << "Failed to open recording " << path << std::endl;
+			return false;
+		}
+		if (file.size() < sizeof(header))
+		{
+			file.close();
+			return false;
+		}
+		memcpy(&header, file.data(), sizeof(header));
+		if (header.magic != Recording::MAGIC || header.version != Recording::VERSION || header.frameCount == 0
+			|| header.indexOffset + header.frameCount * sizeof(uint64_t) > file.size())
+		{
+			std::cout << "Recording " << path << " is incomplete or from another version" << std::endl;
+			file.close();
+			return false;
+		}
+		decodedFrame = -1;
+		playTime = 0.0f;
+		return true;
+	}
+	bool isOpen() const
+	{
+		return file.data() != NULL;
+	}
+	int numFrames() const
+	{
+		return (int)header.frameCount;
+	}
+	int maxParticles() const
+	{
+		return (int)header.maxParticles;
+	}
+	float duration() const
+	{
+		return frameHeader(numFrames() - 1).time;
+	}
+	float time() const
+	{
+		return playTime;
+	}
+	// jump to a time, wrapping around the recording
+	void seek(float t)
+	{
+		float length = duration();
+		if (length <= 0.0f)
+			t = 0.0f;
+		else
+			t = fmodf(t, length);
+		playTime = t < 0.0f ? t + length : t;
+	}
+	// move the clock on by dt and decode the frame showing at the new time. Returns the
+	// number of particles written, at most capacity.
+	int advance(float dt, int capacity, glm::vec4* posSize, glm::vec4* color, float* sprite)
+	{
+		seek(playTime + dt);
+		return decodeFrame(frameAt(playTime), capacity, posSize, color, sprite);
+	}
+	// last frame recorded at or before t
+	int frameAt(float t) const
+	{
+		int low = 0, high = numFrames() - 1;
+		while (low < high)
+		{
+			int mid = (low + high + 1) / 2;
+			if (frameHeader(mid).time <= t)
+				low = mid;
+			else
+				high = mid - 1;
+		}
+		return low;
+	}
+	int decodeFrame(int frame, int capacity, glm::vec4* posSize, glm::vec4* color, float* sprite)
+	{
+		if (frame != decodedFrame)
+		{
+			// continue from the current frame if we can, otherwise from the keyframe before
+			int start = frame - frame % (int)header.keyframeInterval;
+			if (decodedFrame >= start && decodedFrame < frame)
+				start = decodedFrame + 1;
+			for (int f = start; f <= frame; f++)
+			{
+				Recording::FrameHeader h = frameHeader(f);
+				const unsigned char* payload = file.data() + frameOffset(f) + sizeof(Recording::FrameHeader);
+				payload = Recording::decodeIds(payload, (int)h.count, ids);
+				Recording::matchPrevious(ids, (int)h.count, slots, h.keyframe ? NULL : &index, base);
+				Recording::decodeValues(payload, (int)h.count, base);
+				std::swap(base, slots);
+				Recording::indexIds(ids, (int)h.count, index);
+				decodedCount = (int)h.count;
+				decodedFrame = f;
+			}
+		}
+
+		int count = std::min(decodedCount, capacity);
+		for (int i = 0; i < count; i++)
+		{
+			const int32_t* v = &slots[(size_t)i * Recording::CHANNELS];
+			posSize[i] = glm::vec4(v[0], v[1], v[2], v[3]) * (1.0f / Recording::POSITION_SCALE);
+			color[i] = glm::vec4(v[4], v[5], v[6], v[7]) * (1.0f / 255.0f);
+			if (sprite)
+				sprite[i] = (float)v[8];
+		}
+		return count;
+	}
+
+private:
+	MappedFile file;
+	Recording::FileHeader header;
+	std::vector<int32_t> slots; // quantized values of decodedFrame
+	std::vector<uint32_t> ids; // and its particles' ids
+	Recording::IdIndex index; // where each of those ids is in slots
+	std::vector<int32_t> base;
+	int decodedFrame = -1, decodedCount = 0;
+	float playTime = 0.0f;
+
+	uint64_t frameOffset(int frame) const
+	{
+		uint64_t offset;
+		memcpy(&offset, file.data() + header.indexOffset + frame * sizeof(uint64_t), sizeof(offset));
+		return offset;
+	}
+	Recording::FrameHeader frameHeader(int frame) const
+	{
+		Recording::FrameHeader h;
+		memcpy(&h, file.data() + frameOffset(frame), sizeof(h));
+		return h;
+	}
+};
+#endif
@@ -7,6 +7,8 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include "gl_ext.h"
+
 #include <string>
 #include <fstream>
 #include <sstream>
@@ -73,6 +75,43 @@ public:
 		glDeleteShader(fragment);
 
 	}
+	// constructor for a compute program, needs a 4.3 context (see glExt().computeDraw)
+	// ------------------------------------------------------------------------
+	explicit Shader(const char* computePath)
+	{
+		std::string computeCode;
+		std::ifstream cShaderFile;
+		cShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		try
+		{
+			cShaderFile.open(computePath);
+			std::stringstream cShaderStream;
+			cShaderStream << cShaderFile.rdbuf();
+			cShaderFile.close();
+			computeCode = cShaderStream.str();
+		}
+		catch (std::ifstream::failure& e)
+		{
+			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
+		}
+		const char* cShaderCode = computeCode.c_str();
+		unsigned int compute = glCreateShader(GL_COMPUTE_SHADER);
+		glShaderSource(compute, 1, &cShaderCode, NULL);
+		glCompileShader(compute);
+		checkCompileErrors(compute, "COMPUTE");
+		ID = glCreateProgram();
+		glAttachShader(ID, compute);
+		glLinkProgram(ID);
+		checkCompileErrors(ID, "PROGRAM");
+		glDeleteShader(compute);
+	}
+	// true if the program linked
+	bool isLinked() const
+	{
+		GLint success = GL_FALSE;
+		glGetProgramiv(ID, GL_LINK_STATUS, &success);
+		return success == GL_TRUE;
+	}
 	// activate the shader
 	// ------------------------------------------------------------------------
 	void use() const
@@ -0,0 +1,82 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/// snapshot.h
+/// saves and restores a scene's whole simulation state. The state is one trivially
+/// copyable struct, written after a small header in a single write and restored by
+/// mapping the file and copying it back in one go - nothing is parsed per particle.
+
+#include "mappedfile.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+#include <iostream>
+
+const uint32_t SNAPSHOT_MAGIC = 0x50414E53; // "SNAP"
+// bump whenever a scene's state struct changes layout
+const uint32_t SNAPSHOT_VERSION = 7;
+
+struct SnapshotHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t scene; // which program wrote it, snapshots don't cross scenes
+	uint32_t reserved;
+	uint64_t stateSize;
+};
+
+template<class State>
+bool saveSnapshot(const char* path, uint32_t scene, const State& state)
+{
+	static_assert(std::is_trivially_copyable<State>::value, "snapshot state must be plain data");
+	SnapshotHeader header;
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.scene = scene;
+	header.reserved = 0;
+	header.stateSize = sizeof(State);
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+	{
+		std::cout << "Failed to write snapshot " << path << std::endl;
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(&state, sizeof(State), 1, file) == 1;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok)
+		std::cout << "Failed to write snapshot " << path << std::endl;
+	return ok;
+}
+
+// state is left untouched unless the whole snapshot matches
+template<class State>
+bool loadSnapshot(const char* path, uint32_t scene, State& state)
+{
+	static_assert(std::is_trivially_copyable<State>::value, "snapshot state must be plain data");
+	MappedFile file;
+	if (!file.open(path))
+	{
+		std::cout << "Failed to open snapshot " << path << std::endl;
+		return false;
+	}
+	SnapshotHeader header;
+	if (file.size() < sizeof(header))
+	{
+		std::cout << "Snapshot " << path << " is truncated" << std::endl;
+		return false;
+	}
+	memcpy(&header, file.data(), sizeof(header));
+	if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.scene != scene
+		|| header.stateSize != sizeof(State) || file.size() < sizeof(header) + sizeof(State))
+	{
+		std::cout << "Snapshot " << path << " doesn't match this build or scene" << std::endl;
+		return false;
+	}
+	memcpy(&state, file.data() + sizeof(header), sizeof(State));
+	return true;
+}
+#endif
@@ -0,0 +1,113 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+/// timingwheel.h
+/// hierarchical timing wheel for particle lifetimes. Each particle is filed once at spawn
+/// under the tick it expires on, and every tick hands back the whole bucket that is due
+/// instead of every particle checking its own clock. Three levels of 256 buckets cover
+/// 2^24 ticks (over three days at 60 ticks a second); anything further waits in an
+/// overflow list. Far buckets are cascaded into nearer levels as the wheel turns, so every
+/// entry is moved at most once per level.
+
+#include <stdint.h>
+
+#include <vector>
+#include <utility>
+
+class TimingWheel
+{
+public:
+	struct Entry
+	{
+		int slot;
+		unsigned int id; // the particle's, so a slot reused since can be told apart
+		uint32_t tick; // expires at the start of this tick
+	};
+
+	TimingWheel() : wheel(levels * bucketsPerLevel) {}
+
+	// starts over at tick, with nothing scheduled
+	// ------------------------------------------------------------------------
+	void reset(uint32_t tick)
+	{
+		for (std::vector<Entry>& bucket : wheel)
+			bucket.clear();
+		overflow.clear();
+		now = tick;
+	}
+	// file slot under tick, which must be later than the current one
+	// ------------------------------------------------------------------------
+	void schedule(int slot, unsigned int id, uint32_t tick)
+	{
+		Entry e = { slot, id, tick };
+		file(e);
+	}
+	// moves on to the next tick and swaps its expired entries into expired
+	// ------------------------------------------------------------------------
+	void advance(std::vector<Entry>& expired)
+	{
+		now++;
+		// bring the next stretch of each outer level in before it's needed, outermost first
+		if ((now & levelMask(2)) == 0)
+		{
+			std::vector<Entry> waiting;
+			waiting.swap(overflow);
+			for (const Entry& e : waiting)
+				file(e);
+		}
+		for (int level = levels - 1; level > 0; level--)
+		{
+			if ((now & levelMask(level)) == 0)
+				cascade(level);
+		}
+		expired.clear();
+		expired.swap(wheel[bucketIndex(0, now)]);
+	}
+	uint32_t currentTick() const
+	{
+		return now;
+	}
+
+private:
+	static const int levels = 3;
+	static const int bitsPerLevel = 8;
+	static const int bucketsPerLevel = 1 << bitsPerLevel;
+
+	std::vector<std::vector<Entry>> wheel; // level by level
+	std::vector<Entry> overflow; // beyond the outermost level
+	uint32_t now = 0;
+
+	// the low bits that are all zero when this level's next bucket comes due
+	static uint32_t levelMask(int level)
+	{
+		return (1u << (bitsPerLevel * level)) - 1;
+	}
+	static int bucketIndex(int level, uint32_t tick)
+	{
+		return level * bucketsPerLevel + (int)((tick >> (bitsPerLevel * level)) & (bucketsPerLevel - 1));
+	}
+
+	// nearest level whose span still reaches e.tick
+	void file(const Entry& e)
+	{
+		uint32_t delta = e.tick - now;
+		for (int level = 0; level < levels; level++)
+		{
+			if (delta < (1u << (bitsPerLevel * (level + 1))))
+			{
+				wheel[bucketIndex(level, e.tick)].push_back(e);
+				return;
+			}
+		}
+		overflow.push_back(e);
+	}
+	// every entry of the level's current bucket is now close enough for a nearer level
+	void cascade(int level)
+	{
+		std::vector<Entry> due;
+		due.swap(wheel[bucketIndex(level, now)]);
+		for (const Entry& e : due)
+			file(e);
+	}
+};
+#endif